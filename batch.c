@@ -0,0 +1,81 @@
+#include "batch.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+static uint64_t free_paths_scalar(const geom_mask *masks, const geom_mask *blocked,
+                                  int i, int n) {
+    uint64_t out = 0;
+    for (; i < n; i++)
+        if (!(masks[i] & blocked[i])) out |= (uint64_t)1 << i;
+    return out;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static uint64_t free_paths_avx2(const geom_mask *masks, const geom_mask *blocked, int n) {
+    uint64_t out = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i m = _mm256_loadu_si256((const __m256i*)(masks + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(blocked + i));
+        __m256i z = _mm256_cmpeq_epi64(_mm256_and_si256(m, b), _mm256_setzero_si256());
+        out |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(z)) << i;
+    }
+    return out | free_paths_scalar(masks, blocked, i, n);
+}
+
+
+__attribute__((target("avx512f")))
+static uint64_t free_paths_avx512(const geom_mask *masks, const geom_mask *blocked, int n) {
+    uint64_t out = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i m = _mm512_loadu_si512(masks + i);
+        __m512i b = _mm512_loadu_si512(blocked + i);
+        out |= (uint64_t)_mm512_testn_epi64_mask(m, b) << i;
+    }
+    if (i < n) {
+        // tail: masked loads, lanes past n read as zero and are dropped
+        __mmask8 k = (__mmask8)((1u << (n - i)) - 1);
+        __m512i m = _mm512_maskz_loadu_epi64(k, masks + i);
+        __m512i b = _mm512_maskz_loadu_epi64(k, blocked + i);
+        out |= (uint64_t)(_mm512_testn_epi64_mask(m, b) & k) << i;
+    }
+    return out;
+}
+
+#endif
+
+
+typedef uint64_t (*free_paths_fn)(const geom_mask*, const geom_mask*, int);
+
+static uint64_t free_paths_generic(const geom_mask *masks, const geom_mask *blocked, int n) {
+    return free_paths_scalar(masks, blocked, 0, n);
+}
+
+static free_paths_fn free_paths_impl;
+
+
+static free_paths_fn pick_impl(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return free_paths_avx512;
+    if (__builtin_cpu_supports("avx2"))    return free_paths_avx2;
+#endif
+    return free_paths_generic;
+}
+
+
+uint64_t batch_free_paths(const geom_mask *masks, const geom_mask *blocked, int n) {
+    // racing first calls all store the same pointer
+    free_paths_fn f = __atomic_load_n(&free_paths_impl, __ATOMIC_RELAXED);
+    if (!f) {
+        f = pick_impl();
+        __atomic_store_n(&free_paths_impl, f, __ATOMIC_RELAXED);
+    }
+    return f(masks, blocked, n);
+}
@@ -0,0 +1,21 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "geom.h"
+
+
+// Batch conflict test for candidate admissions
+//
+// A scheduler choosing among many waiting cars tests each one's path
+// against the cells it may not enter: masks[i] & blocked[i]. This does
+// the whole set at once, 8 candidates per instruction with AVX-512, 4
+// with AVX2, one at a time otherwise; the variant is picked on first use
+// from what the CPU supports, so no special compiler flags are needed.
+
+#define BATCH_MAX 64
+
+// Bit i of the result is set when masks[i] & blocked[i] == 0; n <= BATCH_MAX
+uint64_t batch_free_paths(const geom_mask *masks, const geom_mask *blocked, int n);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cols.h"
+
+
+// cid, orig and target, then NTIMES int64 columns
+#define NTIMES 7
+#define NCOLS  (3 + NTIMES)
+
+static const struct {
+    char type;
+    const char *name;
+} col_def[NCOLS] = {
+    { 'i', "cid" },   { 'c', "orig" },  { 'c', "target" },
+    { 'q', "arrive" }, { 'q', "stop" }, { 'q', "front" }, { 'q', "grant" },
+    { 'q', "cross" }, { 'q', "exit" },  { 'q', "delay" }
+};
+
+
+struct cols_writer {
+    FILE *f;
+    uint32_t n;          // rows in the current chunk
+    uint64_t total;
+    int32_t cid[COLS_CHUNK];
+    char orig[COLS_CHUNK];
+    char target[COLS_CHUNK];
+    int64_t time[NTIMES][COLS_CHUNK];   // arrive .. exit, delay
+};
+
+
+cols_writer *cols_open(const char *path) {
+    cols_writer *w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+    w->f = fopen(path, "wb");
+    if (!w->f) {
+        perror(path);
+        free(w);
+        return NULL;
+    }
+
+    uint32_t ncols = NCOLS;
+    fwrite(COLS_MAGIC, 1, 8, w->f);
+    fwrite(&ncols, sizeof(ncols), 1, w->f);
+    for (int c = 0; c < NCOLS; c++) {
+        char name[15] = {0};
+        strncpy(name, col_def[c].name, sizeof(name) - 1);
+        fputc(col_def[c].type, w->f);
+        fwrite(name, 1, sizeof(name), w->f);
+    }
+    return w;
+}
+
+
+static void flush_chunk(cols_writer *w) {
+    if (w->n == 0) return;
+    fwrite(&w->n, sizeof(w->n), 1, w->f);
+    fwrite(w->cid, sizeof(int32_t), w->n, w->f);
+    fwrite(w->orig, 1, w->n, w->f);
+    fwrite(w->target, 1, w->n, w->f);
+    for (int c = 0; c < NTIMES; c++)
+        fwrite(w->time[c], sizeof(int64_t), w->n, w->f);
+    w->total += w->n;
+    w->n = 0;
+}
+
+
+void cols_add(cols_writer *w, const trace_car *car, int64_t delay) {
+    uint32_t i = w->n++;
+    w->cid[i] = car->cid;
+    w->orig[i] = car->orig;
+    w->target[i] = car->target;
+    const int64_t t[NTIMES] = { car->arrive, car->stop, car->front, car->grant,
+                                car->cross, car->exit, delay };
+    for (int c = 0; c < NTIMES; c++)
+        w->time[c][i] = t[c];
+    if (w->n == COLS_CHUNK) flush_chunk(w);
+}
+
+
+int cols_close(cols_writer *w) {
+    flush_chunk(w);
+    uint32_t end = 0;
+    fwrite(&end, sizeof(end), 1, w->f);
+    fwrite(&w->total, sizeof(w->total), 1, w->f);
+    int err = ferror(w->f);
+    err |= fclose(w->f) != 0;
+    free(w);
+    return err ? -1 : 0;
+}
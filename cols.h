@@ -0,0 +1,42 @@
+#ifndef COLS_H
+#define COLS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "trace.h"
+
+
+// Per-car results as a column-chunk file
+//
+// One row per car that exited, written in chunks of up to COLS_CHUNK
+// rows so a writer needs only one chunk of memory however many cars a
+// run has. Within a chunk every column is stored contiguously, so a
+// reader can map a column straight into an array (numpy.frombuffer).
+//
+// Layout, host byte order:
+//
+//   "TCCOLS01"
+//   uint32 ncols, then per column: uint8 type ('i' int32, 'q' int64,
+//   'c' char) and a 15-byte NUL-padded name
+//   chunks: uint32 nrows (> 0), then each column's nrows values in
+//   header order
+//   uint32 0, uint64 total rows
+//
+// Columns: cid, orig, target, then arrive, stop, front, grant, cross,
+// exit (microseconds, -1 if the car never had that phase; see trace.h)
+// and delay (exit - arrive minus the stop the car made, none for a
+// platoon follower that did not stop, and its actual crossing time, see
+// xt_draw()).
+
+#define COLS_MAGIC "TCCOLS01"
+#define COLS_CHUNK 65536
+
+typedef struct cols_writer cols_writer;
+
+// Returns NULL (after printing why) if path cannot be opened
+cols_writer *cols_open(const char *path);
+void         cols_add(cols_writer *w, const trace_car *car, int64_t delay);
+// Flushes the last chunk and closes; 0 on success, -1 on a write error
+int          cols_close(cols_writer *w);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stdint.h>
+
+
+// Binary event log
+//
+// The compact form of the "Time T: Car N (o t) event" lines tc prints:
+// EVLOG_MAGIC, then one fixed-size record per car phase change in time
+// order, host byte order. Written by sweep --events and read by validate.
+
+#define EVLOG_MAGIC "TCEVLOG1"
+#define EVLOG_MAGIC_LEN 8
+
+#define EVLOG_ARRIVING 0
+#define EVLOG_CROSSING 1
+#define EVLOG_EXITING  2
+
+typedef struct {
+    int64_t time;        // microseconds
+    int32_t cid;
+    uint8_t type;        // EVLOG_*
+    char orig;
+    char target;
+    uint8_t pad;
+} evlog_rec;
+
+#endif
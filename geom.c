@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include "geom.h"
+
+
+// Quadrant indices of the default 4-way
+
+#define Q_NW 0
+#define Q_NE 1
+#define Q_SW 2
+#define Q_SE 3
+
+
+static void geom_clear(geom *g) {
+    memset(g, 0, sizeof(*g));
+    memset(g->move_turn, TURN_NONE, sizeof(g->move_turn));
+}
+
+
+static void add_move(geom *g, int o, int t, int turn, const int *path, int n) {
+    g->move_mask[o][t] = 0;
+    g->move_turn[o][t] = (signed char)turn;
+    g->move_plen[o][t] = (unsigned char)n;
+    for (int i = 0; i < n; i++) {
+        g->move_mask[o][t] |= geom_cell(path[i]);
+        g->move_path[o][t][i] = (unsigned char)path[i];
+    }
+}
+
+#define MOVE(o, t, turn, ...) do { \
+        static const int path_[] = { __VA_ARGS__ }; \
+        add_move(g, o, t, turn, path_, sizeof(path_) / sizeof(int)); \
+    } while (0)
+
+
+void geom_default(geom *g) {
+    geom_clear(g);
+    g->ncells = 4;
+    g->nlegs = 4;
+    memcpy(g->leg_sym, "^v><", 4);
+    for (int i = 0; i < 4; i++)
+        g->nlanes[i] = 1;
+
+    enum { N, S, E, W };
+
+    MOVE(N, N, TURN_STRAIGHT, Q_SW, Q_NW);
+    MOVE(N, E, TURN_RIGHT,    Q_SW);
+    MOVE(N, W, TURN_LEFT,     Q_SW, Q_NW, Q_NE);
+
+    MOVE(S, S, TURN_STRAIGHT, Q_NE, Q_SE);
+    MOVE(S, W, TURN_RIGHT,    Q_NE);
+    MOVE(S, E, TURN_LEFT,     Q_NE, Q_SE, Q_SW);
+
+    MOVE(E, E, TURN_STRAIGHT, Q_NW, Q_NE);
+    MOVE(E, S, TURN_RIGHT,    Q_NW);
+    MOVE(E, N, TURN_LEFT,     Q_NW, Q_NE, Q_SE);
+
+    MOVE(W, W, TURN_STRAIGHT, Q_SE, Q_SW);
+    MOVE(W, N, TURN_RIGHT,    Q_SE);
+    MOVE(W, S, TURN_LEFT,     Q_SE, Q_SW, Q_NW);
+}
+
+
+int geom_leg(const geom *g, char sym) {
+    for (int i = 0; i < g->nlegs; i++)
+        if (g->leg_sym[i] == sym) return i;
+    return -1;
+}
+
+
+static int parse_turn(const char *s) {
+    if (!strcmp(s, "left"))     return TURN_LEFT;
+    if (!strcmp(s, "straight")) return TURN_STRAIGHT;
+    if (!strcmp(s, "right"))    return TURN_RIGHT;
+    return TURN_NONE;
+}
+
+
+int geom_load(geom *g, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    geom_clear(g);
+
+    char line[512];
+    int lineno = 0;
+    const char *err = NULL;
+
+    while (!err && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = 0;
+
+        char word[16];
+        int pos;
+        if (sscanf(line, " %15s%n", word, &pos) != 1) continue;
+        char *rest = line + pos;
+
+        if (!strcmp(word, "cells")) {
+            if (g->ncells)
+                err = "duplicate cells";
+            else if (sscanf(rest, "%d", &g->ncells) != 1 ||
+                     g->ncells < 1 || g->ncells > GEOM_MAX_CELLS)
+                err = "cell count must be 1..64";
+        } else if (!strcmp(word, "leg")) {
+            char sym;
+            int lanes = 1;
+            int k = sscanf(rest, " %c %d", &sym, &lanes);
+            if (k < 1)                          err = "missing leg symbol";
+            else if (geom_leg(g, sym) >= 0)     err = "duplicate leg";
+            else if (g->nlegs == GEOM_MAX_LEGS) err = "too many legs";
+            else if (lanes < 1 || lanes > GEOM_MAX_LANES) err = "lane count must be 1..4";
+            else {
+                g->nlanes[g->nlegs] = lanes;
+                g->leg_sym[g->nlegs++] = sym;
+            }
+        } else if (!strcmp(word, "move")) {
+            char o, t, turn[16];
+            int n;
+            if (sscanf(rest, " %c %c %15s%n", &o, &t, turn, &n) != 3) {
+                err = "expected: move orig target turn cell...";
+                break;
+            }
+            int oi = geom_leg(g, o), ti = geom_leg(g, t), tt = parse_turn(turn);
+            if (oi < 0 || ti < 0) { err = "unknown leg"; break; }
+            if (tt == TURN_NONE)  { err = "turn must be left, straight or right"; break; }
+            if (!g->ncells)       { err = "cells must come before moves"; break; }
+            if (g->move_turn[oi][ti] != TURN_NONE) { err = "duplicate move"; break; }
+
+            int path[GEOM_MAX_PATH], plen = 0;
+            geom_mask seen = 0;
+            char *p = rest + n;
+            int cell, used, lane = 0, cls = 0;
+            if (sscanf(p, " lane %d%n", &lane, &used) == 1) {
+                if (lane < 0 || lane >= g->nlanes[oi]) { err = "lane out of range"; break; }
+                p += used;
+            }
+            if (sscanf(p, " share %d%n", &cls, &used) == 1) {
+                if (cls < 1 || cls > GEOM_MAX_CLASSES) { err = "share class must be 1..8"; break; }
+                p += used;
+            }
+            while (sscanf(p, "%d%n", &cell, &used) == 1) {
+                if (cell < 0 || cell >= g->ncells) { err = "cell out of range"; break; }
+                if (plen == GEOM_MAX_PATH)        { err = "path too long"; break; }
+                if (seen & geom_cell(cell))       { err = "cell listed twice in path"; break; }
+                seen |= geom_cell(cell);
+                path[plen++] = cell;
+                p += used;
+            }
+            if (err) break;
+
+            // anything left over (a non-number, or lane after share) would
+            // otherwise cut the path short or leave it empty, and a move
+            // with no cells conflicts with nothing
+            p += strspn(p, " \t\r\n");
+            if (*p)        { err = "unexpected text; expected [lane L] [share K] cell..."; break; }
+            if (plen == 0) { err = "move needs at least one cell"; break; }
+            add_move(g, oi, ti, tt, path, plen);
+            g->move_lane[oi][ti] = (signed char)lane;
+            g->move_class[oi][ti] = (unsigned char)cls;
+        } else {
+            err = "unknown directive";
+        }
+    }
+    fclose(f);
+
+    if (!err && (g->nlegs == 0 || g->ncells == 0)) {
+        err = "no legs or cells declared";
+        lineno = 0;
+    }
+    if (err) {
+        fprintf(stderr, "%s:%d: %s\n", path, lineno, err);
+        return -1;
+    }
+    return 0;
+}
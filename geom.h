@@ -0,0 +1,91 @@
+#ifndef GEOM_H
+#define GEOM_H
+
+#include <stdint.h>
+
+
+// Intersection geometry as data
+//
+// An intersection has up to GEOM_MAX_LEGS approach legs, each named by
+// the direction symbol cars use for it ('^', 'v', '>', '<' on the default
+// 4-way) and split into up to GEOM_MAX_LANES lanes, plus up to
+// GEOM_MAX_CELLS conflict cells. Every allowed movement (orig leg, target
+// leg) is served by one lane of its leg and lists the cells it occupies
+// as a 64-bit mask, so a conflict test is a single AND.
+//
+// File format, one directive per line, '#' starts a comment:
+//
+//   cells 16                      number of conflict cells
+//   leg ^ 2                       declare a leg and its lane count (default 1)
+//   move ^ < left lane 0 0 1 5    orig target turn [lane L] [share K] cell...
+//
+// turn is left, straight or right and selects the crossing time. Each
+// lane has its own queue; lanes are numbered 0.. within their leg. Cells
+// are listed in the order the car drives through them, each at most
+// once; reservation mode uses that order to work out when each cell is
+// occupied. cells comes once, before any move, and each (orig, target)
+// pair has one move line.
+//
+// A cell is shared by cars with the same sharing key. By default the key
+// is the car's leg, so only cars from one leg overlap in a cell. share K
+// (1..GEOM_MAX_CLASSES) puts the movement in compatibility class K
+// instead: it then shares cells with class-K movements from any leg,
+// e.g. parallel through lanes that never actually cross.
+
+#define GEOM_MAX_LEGS  8
+#define GEOM_MAX_LANES 4
+#define GEOM_MAX_CELLS 64
+#define GEOM_MAX_PATH  32
+#define GEOM_MAX_CLASSES 8
+
+// Lanes are numbered leg * GEOM_MAX_LANES + lane across the intersection
+#define GEOM_LANE_SLOTS (GEOM_MAX_LEGS * GEOM_MAX_LANES)
+
+// Sharing keys: legs first, then compatibility classes
+#define GEOM_MAX_KEYS (GEOM_MAX_LEGS + GEOM_MAX_CLASSES)
+
+#define TURN_STRAIGHT 0
+#define TURN_LEFT     1
+#define TURN_RIGHT    2
+#define TURN_NONE     (-1)
+
+typedef uint64_t geom_mask;
+
+typedef struct {
+    int ncells;
+    int nlegs;
+    char leg_sym[GEOM_MAX_LEGS];
+    int nlanes[GEOM_MAX_LEGS];
+    geom_mask move_mask[GEOM_MAX_LEGS][GEOM_MAX_LEGS];
+    signed char move_turn[GEOM_MAX_LEGS][GEOM_MAX_LEGS];   // TURN_*
+    signed char move_lane[GEOM_MAX_LEGS][GEOM_MAX_LEGS];   // lane within orig leg
+    unsigned char move_class[GEOM_MAX_LEGS][GEOM_MAX_LEGS]; // 0 = exclusive to leg
+    unsigned char move_plen[GEOM_MAX_LEGS][GEOM_MAX_LEGS];
+    unsigned char move_path[GEOM_MAX_LEGS][GEOM_MAX_LEGS][GEOM_MAX_PATH];  // cells in driving order
+} geom;
+
+// Standard 4-way stop with quadrants NW, NE, SW, SE
+void geom_default(geom *g);
+
+// Returns 0 on success; prints a message and returns -1 on error
+int  geom_load(geom *g, const char *path);
+
+// Leg index for a direction symbol, -1 if unknown
+int  geom_leg(const geom *g, char sym);
+
+static inline geom_mask geom_cell(int c) {
+    return (geom_mask)1 << c;
+}
+
+// Intersection-wide lane slot serving a movement
+static inline int geom_lane(const geom *g, int orig, int target) {
+    return orig * GEOM_MAX_LANES + g->move_lane[orig][target];
+}
+
+// Sharing key of a movement, 0..GEOM_MAX_KEYS-1
+static inline int geom_key(const geom *g, int orig, int target) {
+    int k = g->move_class[orig][target];
+    return k ? GEOM_MAX_LEGS + k - 1 : orig;
+}
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+
+// Upper bounds of the finite histogram buckets, seconds
+
+static const double bucket_le[METRICS_BUCKETS - 1] = {
+    0.5, 1, 2, 5, 10, 20, 50, 100, 200
+};
+
+
+struct metrics_server {
+    int fd;
+    int wake[2];         // self-pipe: a byte here stops the thread
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    pthread_t thread;
+    metrics_render_fn render;
+    metrics_tick_fn tick;
+    void *user;
+};
+
+
+// Sends to a client socket. MSG_NOSIGNAL turns a client that already
+// hung up into EPIPE instead of a SIGPIPE that would end the process;
+// either way the client is gone and the rest is dropped.
+
+static void send_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t k = send(fd, buf, n, MSG_NOSIGNAL);
+        if (k <= 0) return;
+        buf += k;
+        n -= (size_t)k;
+    }
+}
+
+
+// Answers one client; req holds what it sent, n bytes, if anything
+
+static void answer(metrics_server *srv, int c, const char *req, ssize_t n) {
+    int http = n >= 4 && !memcmp(req, "GET ", 4);
+
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) return;
+    srv->render(out, srv->user);
+    fclose(out);
+
+    if (http) {
+        char head[128];
+        int h = snprintf(head, sizeof(head),
+                         "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n\r\n", len);
+        send_all(c, head, (size_t)h);
+    }
+    send_all(c, body, len);
+    free(body);
+}
+
+
+#define TICK_MS 1000
+
+// A request, if any, arrives right after connect; a silent client gets
+// the bare text after GRACE_MS. Up to MAX_PENDING clients wait at once.
+#define GRACE_MS    100
+#define MAX_PENDING 16
+
+
+static int64_t mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+typedef struct {
+    int fd;
+    int64_t deadline;    // answer without a request from then on
+} pending;
+
+
+// Ticks run off a monotonic deadline checked on every pass, so steady
+// scrapes cannot hold them off; after a stall the next tick is a full
+// period later rather than a burst of catch-up ticks. Clients are
+// polled together with the socket and only read once readable, so a
+// silent client never holds up the loop; it is answered when its grace
+// period ends.
+
+static void *server_thread(void *arg) {
+    metrics_server *srv = arg;
+    pending pend[MAX_PENDING];
+    int npend = 0;
+    int64_t next_tick = mono_ms() + TICK_MS;
+
+    for (;;) {
+        int64_t now = mono_ms();
+        if (now >= next_tick) {
+            if (srv->tick) srv->tick(srv->user);
+            next_tick += TICK_MS;
+            if (next_tick <= now) next_tick = now + TICK_MS;
+            continue;
+        }
+
+        int64_t until = next_tick;
+        struct pollfd p[2 + MAX_PENDING] = {
+            { srv->wake[0], POLLIN, 0 },
+            { npend < MAX_PENDING ? srv->fd : -1, POLLIN, 0 }
+        };
+        for (int i = 0; i < npend; i++) {
+            p[2 + i] = (struct pollfd){ pend[i].fd, POLLIN, 0 };
+            if (pend[i].deadline < until) until = pend[i].deadline;
+        }
+        int k = poll(p, 2 + npend, until > now ? (int)(until - now) : 0);
+        if (k < 0) continue;
+        if (p[0].revents) break;
+
+        // answer readable or overdue clients, keeping the rest in order
+        now = mono_ms();
+        int kept = 0;
+        for (int i = 0; i < npend; i++) {
+            if (p[2 + i].revents) {
+                char req[1024];
+                ssize_t n = read(pend[i].fd, req, sizeof(req) - 1);
+                answer(srv, pend[i].fd, req, n);
+            } else if (now >= pend[i].deadline) {
+                answer(srv, pend[i].fd, NULL, 0);
+            } else {
+                pend[kept++] = pend[i];
+                continue;
+            }
+            close(pend[i].fd);
+        }
+        npend = kept;
+
+        if (p[1].revents) {
+            int c = accept(srv->fd, NULL, NULL);
+            if (c >= 0) pend[npend++] = (pending){ c, now + GRACE_MS };
+        }
+    }
+    for (int i = 0; i < npend; i++)
+        close(pend[i].fd);
+    return NULL;
+}
+
+
+metrics_server *metrics_serve(const char *path, metrics_render_fn render,
+                              metrics_tick_fn tick, void *user) {
+    metrics_server *srv = calloc(1, sizeof(*srv));
+    if (!srv) return NULL;
+    if (strlen(path) >= sizeof(srv->path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        free(srv);
+        return NULL;
+    }
+    strcpy(srv->path, path);
+    srv->render = render;
+    srv->tick = tick;
+    srv->user = user;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    srv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv->fd < 0 || bind(srv->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(srv->fd, 8) != 0 || pipe(srv->wake) != 0) {
+        perror(path);
+        if (srv->fd >= 0) close(srv->fd);
+        unlink(path);
+        free(srv);
+        return NULL;
+    }
+    if (pthread_create(&srv->thread, NULL, server_thread, srv) != 0) {
+        perror("metrics thread");
+        close(srv->fd);
+        close(srv->wake[0]);
+        close(srv->wake[1]);
+        unlink(path);
+        free(srv);
+        return NULL;
+    }
+    return srv;
+}
+
+
+void metrics_stop(metrics_server *srv) {
+    if (!srv) return;
+    if (write(srv->wake[1], "x", 1) != 1) perror("metrics stop");
+    pthread_join(srv->thread, NULL);
+    close(srv->fd);
+    close(srv->wake[0]);
+    close(srv->wake[1]);
+    unlink(srv->path);
+    free(srv);
+}
+
+
+void metrics_hist_observe(metrics_hist *h, double seconds) {
+    int b = 0;
+    while (b < METRICS_BUCKETS - 1 && seconds > bucket_le[b])
+        b++;
+    atomic_fetch_add_explicit(&h->bucket[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_usec, (long long)(seconds * 1e6),
+                              memory_order_relaxed);
+}
+
+
+void metrics_hist_merge(metrics_hist *into, const metrics_hist *from) {
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+        atomic_fetch_add_explicit(&into->bucket[b],
+                                  atomic_load_explicit(&from->bucket[b], memory_order_relaxed),
+                                  memory_order_relaxed);
+    atomic_fetch_add_explicit(&into->sum_usec,
+                              atomic_load_explicit(&from->sum_usec, memory_order_relaxed),
+                              memory_order_relaxed);
+}
+
+
+// Buckets are stored per interval and written cumulatively
+
+void metrics_hist_write(FILE *out, const char *name, const char *help,
+                        const metrics_hist *h) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    long cum = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        cum += atomic_load_explicit(&h->bucket[b], memory_order_relaxed);
+        if (b < METRICS_BUCKETS - 1)
+            fprintf(out, "%s_bucket{le=\"%g\"} %ld\n", name, bucket_le[b], cum);
+        else
+            fprintf(out, "%s_bucket{le=\"+Inf\"} %ld\n", name, cum);
+    }
+    fprintf(out, "%s_sum %.6f\n", name,
+            atomic_load_explicit(&h->sum_usec, memory_order_relaxed) / 1e6);
+    fprintf(out, "%s_count %ld\n", name, cum);
+}
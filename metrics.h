@@ -0,0 +1,47 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+
+// Prometheus text exporter on a Unix domain socket
+//
+// A background thread accepts connections on a socket path and answers
+// each one with whatever render() writes. A client that sends an HTTP
+// request (curl --unix-socket PATH http://x/metrics) gets an HTTP/1.0
+// response; any other client (socat - UNIX-CONNECT:PATH) gets the bare
+// text. render() and tick() run on the exporter thread and may only read
+// state that is safe to read concurrently, i.e. atomics. tick() is
+// called about once a second and may be NULL.
+
+typedef void (*metrics_render_fn)(FILE *out, void *user);
+typedef void (*metrics_tick_fn)(void *user);
+
+typedef struct metrics_server metrics_server;
+
+// Returns NULL (after printing why) if the socket cannot be set up
+metrics_server *metrics_serve(const char *path, metrics_render_fn render,
+                              metrics_tick_fn tick, void *user);
+
+// Stops the thread and removes the socket file; NULL is ignored
+void            metrics_stop(metrics_server *srv);
+
+
+// Lock-free histogram of seconds with fixed Prometheus buckets
+
+#define METRICS_BUCKETS 10
+
+typedef struct {
+    atomic_long bucket[METRICS_BUCKETS];   // last one is +Inf
+    atomic_llong sum_usec;
+} metrics_hist;
+
+void metrics_hist_observe(metrics_hist *h, double seconds);
+// Adds from into into, e.g. to sum per-thread histograms at scrape time
+void metrics_hist_merge(metrics_hist *into, const metrics_hist *from);
+void metrics_hist_write(FILE *out, const char *name, const char *help,
+                        const metrics_hist *h);
+
+#endif
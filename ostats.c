@@ -0,0 +1,145 @@
+#include <math.h>
+#include "ostats.h"
+
+
+#define SUB (1 << OHIST_SUB_BITS)
+
+
+static int bucket_of(int64_t v) {
+    if (v < SUB) return v < 0 ? 0 : (int)v;
+    int e = 63 - __builtin_clzll((uint64_t)v);
+    if (e >= OHIST_MAX_BITS) return OHIST_BUCKETS - 1;
+    int mant = (int)(v >> (e - OHIST_SUB_BITS)) - SUB;
+    return (e - OHIST_SUB_BITS + 1) * SUB + mant;
+}
+
+
+static int64_t bucket_top(int b) {
+    if (b < SUB) return b;
+    int shift = b / SUB - 1;
+    int64_t low = (int64_t)(SUB + b % SUB) << shift;
+    return low + ((int64_t)1 << shift) - 1;
+}
+
+
+void ohist_add(ohist *h, int64_t v) {
+    h->n++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->count[bucket_of(v)]++;
+}
+
+
+void ohist_add_shared(ohist *h, int64_t v) {
+    __atomic_fetch_add(&h->n, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count[bucket_of(v)], 1, __ATOMIC_RELAXED);
+    int64_t m = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > m && !__atomic_compare_exchange_n(&h->max, &m, v, 1,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+void ohist_merge(ohist *into, const ohist *from) {
+    into->n += from->n;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+    for (int b = 0; b < OHIST_BUCKETS; b++)
+        into->count[b] += from->count[b];
+}
+
+
+// Reads a histogram other threads are still adding to. The fields are
+// read one by one, so n may be a few cars off the bucket total; the
+// quantile walk uses the buckets.
+
+void ohist_merge_shared(ohist *into, const ohist *from) {
+    into->n += __atomic_load_n(&from->n, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    int64_t m = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (m > into->max) into->max = m;
+    for (int b = 0; b < OHIST_BUCKETS; b++)
+        into->count[b] += __atomic_load_n(&from->count[b], __ATOMIC_RELAXED);
+}
+
+
+int64_t ohist_quantile(const ohist *h, double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < OHIST_BUCKETS; b++)
+        total += h->count[b];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(q * (total - 1)) + 1, seen = 0;
+    for (int b = 0; b < OHIST_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= rank) {
+            int64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+void owindow_init(owindow *w, int64_t width) {
+    w->width = width;
+    w->origin = 0;
+    w->cur = -1;
+    w->count = 0;
+    w->min = 0;
+    w->max = 0;
+    w->closed = 0;
+}
+
+
+static void close_window(owindow *w, uint64_t count) {
+    if (w->closed == 0 || count < w->min) w->min = count;
+    if (count > w->max) w->max = count;
+    w->closed++;
+}
+
+
+// Windows start at the first event, so the first one is not cut short
+
+void owindow_add(owindow *w, int64_t t) {
+    if (w->cur < 0) {
+        w->origin = t;
+        w->cur = 0;
+    }
+    int64_t k = (t - w->origin) / w->width;
+    if (k > w->cur) {
+        close_window(w, w->count);
+        int64_t empty = k - w->cur - 1;   // windows with no events at all
+        if (empty > 0) {
+            close_window(w, 0);
+            w->closed += empty - 1;
+        }
+        w->cur = k;
+        w->count = 0;
+    }
+    w->count++;
+}
+
+
+void oema_init(oema *e, double tau) {
+    e->tau = tau;
+    e->value = 0;
+    e->level = 0;
+    e->last = -1;
+}
+
+
+// The interval since the last sample was spent at the previous level,
+// so that level gets its weight; the new one counts from now on
+
+void oema_sample(oema *e, int64_t t, double level) {
+    if (e->last < 0) {
+        e->value = level;
+    } else if (t > e->last) {
+        double a = 1 - exp(-(t - e->last) / e->tau);
+        e->value += a * (e->level - e->value);
+    }
+    e->level = level;
+    e->last = t;
+}
@@ -0,0 +1,77 @@
+#ifndef OSTATS_H
+#define OSTATS_H
+
+#include <stdint.h>
+
+
+// Online statistics with fixed memory
+//
+// Aggregators that are updated once per car and never keep the cars
+// themselves, so a run of any length fits in the same few kilobytes.
+
+
+// Log-linear (HDR-style) histogram of non-negative integers, here
+// microseconds. Values below 2^OHIST_SUB_BITS are exact; above that
+// each power of two is split into 2^OHIST_SUB_BITS buckets, so a
+// quantile is within 1/64 (1.6%) of the true value. Values of 2^36 or
+// more (19 hours) share the last bucket.
+//
+// ohist_add() is for a histogram owned by one thread. Shared histograms
+// use ohist_add_shared(), a relaxed atomic add per field, and are read
+// with ohist_merge_shared(); a writer never waits for a reader.
+
+#define OHIST_SUB_BITS 6
+#define OHIST_MAX_BITS 36
+#define OHIST_BUCKETS ((OHIST_MAX_BITS - OHIST_SUB_BITS + 1) << OHIST_SUB_BITS)
+
+typedef struct {
+    uint64_t n;
+    int64_t sum;
+    int64_t max;
+    uint64_t count[OHIST_BUCKETS];
+} ohist;
+
+void    ohist_add(ohist *h, int64_t v);
+void    ohist_add_shared(ohist *h, int64_t v);
+void    ohist_merge(ohist *into, const ohist *from);
+void    ohist_merge_shared(ohist *into, const ohist *from);
+
+// Upper edge of the bucket holding quantile q (0..1), capped at the
+// largest value seen; 0 when empty
+int64_t ohist_quantile(const ohist *h, double q);
+
+
+// Event counts per fixed window (e.g. cars per simulated minute): the
+// fewest and most in any complete window, counting from the first
+// event. Times must not go backwards.
+
+typedef struct {
+    int64_t width;
+    int64_t origin;      // time of the first event
+    int64_t cur;         // index of the open window, -1 before the first event
+    uint64_t count;      // events in the open window
+    uint64_t min;
+    uint64_t max;
+    uint64_t closed;     // complete windows so far
+} owindow;
+
+void owindow_init(owindow *w, int64_t width);
+void owindow_add(owindow *w, int64_t t);
+
+
+// Exponential moving average of a sampled level (e.g. queue length)
+// with time constant tau; samples may come at any interval. A level
+// holds from its sample until the next one, so value is the average up
+// to the last sample time.
+
+typedef struct {
+    double tau;
+    double value;
+    double level;        // level at the last sample
+    int64_t last;        // time of the last sample, -1 before the first
+} oema;
+
+void   oema_init(oema *e, double tau);
+void   oema_sample(oema *e, int64_t t, double level);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include "pool.h"
+
+
+// Slab header followed by the objects
+
+struct pool_slab {
+    pool_slab *next;
+    // objects start at the next max-aligned offset
+};
+
+#define SLAB_HEADER ((sizeof(pool_slab) + sizeof(max_align_t) - 1) & \
+                     ~(sizeof(max_align_t) - 1))
+
+// Upper bound on slabs kept per thread (4 MiB)
+#define THREAD_CACHE_MAX 64
+
+
+// Per-thread cache of empty slabs
+
+static __thread pool_slab *slab_cache;
+static __thread int slab_cache_count;
+
+
+static pool_slab *slab_alloc(void) {
+    pool_slab *s = slab_cache;
+    if (s) {
+        slab_cache = s->next;
+        slab_cache_count--;
+        return s;
+    }
+    return malloc(POOL_SLAB_BYTES);
+}
+
+
+static void slab_release(pool_slab *s) {
+    if (slab_cache_count >= THREAD_CACHE_MAX) {
+        free(s);
+        return;
+    }
+    s->next = slab_cache;
+    slab_cache = s;
+    slab_cache_count++;
+}
+
+
+int pool_init(pool *p, size_t obj_size) {
+    size_t align = sizeof(max_align_t);
+    if (obj_size < sizeof(void*)) obj_size = sizeof(void*);
+    obj_size = (obj_size + align - 1) & ~(align - 1);
+
+    p->obj_size = obj_size;
+    p->per_slab = (int)((POOL_SLAB_BYTES - SLAB_HEADER) / obj_size);
+    p->free = NULL;
+    p->slabs = NULL;
+    p->live = 0;
+    p->nslabs = 0;
+    return p->per_slab > 0 ? 0 : -1;
+}
+
+
+void pool_destroy(pool *p) {
+    while (p->slabs) {
+        pool_slab *s = p->slabs;
+        p->slabs = s->next;
+        slab_release(s);
+    }
+    p->free = NULL;
+    p->live = 0;
+    p->nslabs = 0;
+}
+
+
+// Carve a fresh slab into the free list
+
+static int pool_grow(pool *p) {
+    pool_slab *s = slab_alloc();
+    if (!s) return -1;
+    s->next = p->slabs;
+    p->slabs = s;
+    p->nslabs++;
+
+    char *base = (char*)s + SLAB_HEADER;
+    for (int i = p->per_slab - 1; i >= 0; i--) {
+        void **obj = (void**)(base + i * p->obj_size);
+        *obj = p->free;
+        p->free = obj;
+    }
+    return 0;
+}
+
+
+void *pool_get(pool *p) {
+    if (!p->free && pool_grow(p) != 0)
+        return NULL;
+    void **obj = p->free;
+    p->free = *obj;
+    p->live++;
+    return obj;
+}
+
+
+void pool_put(pool *p, void *obj) {
+    *(void**)obj = p->free;
+    p->free = obj;
+    p->live--;
+}
+
+
+void pool_put_chain(pool *p, void *first, void *last, int n) {
+    if (!first) return;
+    *(void**)last = p->free;
+    p->free = first;
+    p->live -= n;
+}
+
+
+void pool_trim_thread_cache(void) {
+    while (slab_cache) {
+        pool_slab *s = slab_cache;
+        slab_cache = s->next;
+        free(s);
+    }
+    slab_cache_count = 0;
+}
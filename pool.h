@@ -0,0 +1,43 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+
+// Fixed-size object pool
+//
+// Objects are carved from POOL_SLAB_BYTES slabs and recycled through a
+// free list, so a pool stops calling malloc once it has reached its peak
+// live count. Slabs released by pool_destroy() go to a per-thread cache
+// and are reused by the next pool created on that thread, which keeps
+// back-to-back runs (sweep workers) allocation-free as well.
+//
+// A pool is not thread-safe; each one belongs to a single thread.
+
+#define POOL_SLAB_BYTES (64 * 1024)
+
+typedef struct pool_slab pool_slab;
+
+typedef struct {
+    size_t obj_size;
+    int per_slab;
+    void *free;          // singly linked free objects
+    pool_slab *slabs;
+    int live;            // objects handed out
+    int nslabs;
+} pool;
+
+int   pool_init(pool *p, size_t obj_size);
+void  pool_destroy(pool *p);
+
+void *pool_get(pool *p);
+void  pool_put(pool *p, void *obj);
+
+// Return a chain of objects linked through their first word; n is the
+// chain length
+void  pool_put_chain(pool *p, void *first, void *last, int n);
+
+// Drop this thread's cached slabs
+void  pool_trim_thread_cache(void);
+
+#endif
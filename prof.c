@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include "prof.h"
+
+
+void prof_merge(prof_car *into, const prof_car *from) {
+    for (int f = 0; f < PROF_MAX_FRAMES; f++)
+        into->ticks[f] += from->ticks[f];
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Ticks per nanosecond, timed against the monotonic clock over 20 ms
+
+static double tick_rate(void) {
+    uint64_t ns0 = mono_ns(), t0 = prof_now();
+    struct timespec pause = { 0, 20000000 };
+    nanosleep(&pause, NULL);
+    uint64_t ns1 = mono_ns(), t1 = prof_now();
+    return ns1 > ns0 ? (double)(t1 - t0) / (ns1 - ns0) : 1;
+}
+
+#else
+
+// Ticks are monotonic-clock nanoseconds already
+
+static double tick_rate(void) {
+    return 1;
+}
+
+#endif
+
+
+int prof_write(const char *path, const prof_car *total,
+               const char *const *stack, int nframes) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    double rate = tick_rate();
+    for (int i = 0; i < nframes && i < PROF_MAX_FRAMES; i++) {
+        unsigned long long ns = (unsigned long long)(total->ticks[i] / rate);
+        if (ns > 0 && stack[i])
+            fprintf(f, "%s %llu\n", stack[i], ns);
+    }
+
+    int err = ferror(f);
+    err |= fclose(f) != 0;
+    if (err) perror(path);
+    return err ? -1 : 0;
+}
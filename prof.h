@@ -0,0 +1,61 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+// Phase profiler for sampled cars
+//
+// A sampled car carries a prof_car and calls prof_mark() at every phase
+// boundary. Each mark charges the ticks since the previous mark to the
+// frame just ended, so a car's frames add up to its whole time. Ticks
+// come from the time-stamp counter (rdtsc) where there is one, else
+// from the monotonic clock. The report sums the sampled cars into
+// folded stacks, one "frame;frame;frame weight" line per frame, which
+// flamegraph.pl, speedscope and inferno read directly. Weights are
+// nanoseconds.
+
+#define PROF_MAX_FRAMES 96
+
+typedef struct {
+    uint64_t last;       // tick of the previous mark
+    uint64_t ticks[PROF_MAX_FRAMES];
+} prof_car;
+
+static inline uint64_t prof_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Ends the current frame at tick t; a t before the previous mark (a
+// tick taken on another CPU) charges nothing
+static inline void prof_mark_at(prof_car *p, int frame, uint64_t t) {
+    if (t > p->last) {
+        p->ticks[frame] += t - p->last;
+        p->last = t;
+    }
+}
+
+static inline void prof_mark(prof_car *p, int frame) {
+    prof_mark_at(p, frame, prof_now());
+}
+
+// Adds every frame of from into into
+void prof_merge(prof_car *into, const prof_car *from);
+
+// Writes one line per frame with time, stack[f] naming frame f with
+// ';' between levels. Returns -1 (after printing why) if path cannot be
+// written.
+int  prof_write(const char *path, const prof_car *total,
+                const char *const *stack, int nframes);
+
+#endif
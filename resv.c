@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+#include "resv.h"
+
+
+void resv_init(resv_table *rt, int64_t margin) {
+    memset(rt, 0, sizeof(*rt));
+    rt->margin = margin;
+}
+
+
+void resv_free(resv_table *rt) {
+    for (int c = 0; c < GEOM_MAX_CELLS; c++)
+        free(rt->cells[c].slots);
+    memset(rt->cells, 0, sizeof(rt->cells));
+}
+
+
+// Occupancy of path step i relative to crossing start
+
+static void step_window(const resv_table *rt, int i, int k, int64_t cross_time,
+                        int64_t *from, int64_t *to) {
+    int64_t a = cross_time * i / k - rt->margin;
+    int64_t b = cross_time * (i + 1) / k + rt->margin;
+    *from = a < 0 ? 0 : a;
+    *to = b > cross_time ? cross_time : b;
+}
+
+
+// Drop slots that ended at or before now
+
+static void prune(resv_cell *cell, int64_t now) {
+    int w = 0;
+    for (int r = 0; r < cell->n; r++)
+        if (cell->slots[r].end > now)
+            cell->slots[w++] = cell->slots[r];
+    cell->n = w;
+}
+
+
+int64_t resv_earliest(resv_table *rt, const geom *g, int orig, int target,
+                      int64_t now, int64_t cross_time) {
+    int k = g->move_plen[orig][target];
+    int key = geom_key(g, orig, target);
+    const unsigned char *path = g->move_path[orig][target];
+
+    for (int i = 0; i < k; i++)
+        prune(&rt->cells[path[i]], now);
+
+    // push the start past every conflict until a pass finds none
+    int64_t t = now;
+    int moved = 1;
+    while (moved) {
+        moved = 0;
+        for (int i = 0; i < k; i++) {
+            int64_t from, to;
+            step_window(rt, i, k, cross_time, &from, &to);
+            const resv_cell *cell = &rt->cells[path[i]];
+            for (int r = 0; r < cell->n; r++) {
+                const resv_slot *s = &cell->slots[r];
+                if (s->key == key) continue;
+                if (s->start < t + to && t + from < s->end) {
+                    t = s->end - from;
+                    moved = 1;
+                }
+            }
+        }
+    }
+    return t;
+}
+
+
+int resv_commit(resv_table *rt, const geom *g, int orig, int target,
+                int64_t start, int64_t cross_time) {
+    int k = g->move_plen[orig][target];
+    int key = geom_key(g, orig, target);
+    const unsigned char *path = g->move_path[orig][target];
+
+    // room in every cell first, so that a failure books nothing
+    for (int i = 0; i < k; i++) {
+        resv_cell *cell = &rt->cells[path[i]];
+        if (cell->n + k <= cell->cap) continue;
+        int ncap = cell->cap ? cell->cap * 2 : 8;
+        while (ncap < cell->n + k) ncap *= 2;
+        resv_slot *s = realloc(cell->slots, ncap * sizeof(resv_slot));
+        if (!s) return -1;
+        cell->slots = s;
+        cell->cap = ncap;
+    }
+    for (int i = 0; i < k; i++) {
+        resv_cell *cell = &rt->cells[path[i]];
+        int64_t from, to;
+        step_window(rt, i, k, cross_time, &from, &to);
+        cell->slots[cell->n++] = (resv_slot){ start + from, start + to, key };
+    }
+    return 0;
+}
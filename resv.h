@@ -0,0 +1,55 @@
+#ifndef RESV_H
+#define RESV_H
+
+#include <stdint.h>
+#include "geom.h"
+
+
+// Admission models
+
+#define ADMIT_HOLD    0    // hold every cell of the path for the whole crossing
+#define ADMIT_RESERVE 1    // reserve (cell, time interval) slots along the path
+
+#define RESV_RETRY    1000 // us before planning again after a failed booking
+
+
+// Time-slotted cell reservations
+//
+// A movement with crossing time T and a path of k cells is taken to be in
+// its i-th cell during [i*T/k, (i+1)*T/k), widened by `margin` on both
+// sides (clamped to the crossing) to cover the car's length. Cars with
+// the same sharing key may overlap in a cell, matching the sharing rule
+// of the hold-all model. All times are microseconds.
+
+typedef struct {
+    int64_t start;
+    int64_t end;
+    int key;         // sharing key, see geom_key()
+} resv_slot;
+
+typedef struct {
+    resv_slot *slots;
+    int n;
+    int cap;
+} resv_cell;
+
+typedef struct {
+    resv_cell cells[GEOM_MAX_CELLS];
+    int64_t margin;
+} resv_table;
+
+void    resv_init(resv_table *rt, int64_t margin);
+void    resv_free(resv_table *rt);
+
+// Earliest start >= now at which the whole path is free; drops slots that
+// ended before now along the way
+int64_t resv_earliest(resv_table *rt, const geom *g, int orig, int target,
+                      int64_t now, int64_t cross_time);
+
+// Books the path for a crossing starting at `start`. Returns -1, having
+// booked nothing, if out of memory; the caller plans again after
+// RESV_RETRY, when slots that have ended can be dropped.
+int     resv_commit(resv_table *rt, const geom *g, int orig, int target,
+                    int64_t start, int64_t cross_time);
+
+#endif
@@ -0,0 +1,562 @@
+// Parallel Monte Carlo parameter sweep over the virtual-time simulator
+//
+// Build: gcc -O2 -pthread -o sweep sweep.c vsim.c pool.c geom.c resv.c trace.c
+//        batch.c cols.c ostats.c xtime.c -lm
+//
+// Every parameter takes either a single value or start:stop:step (seconds,
+// or cars/second/direction for --rate). All combinations are run --reps
+// times with random arrivals; each run is an independent vsim on a worker
+// thread. One CSV row per configuration is written once all runs finish.
+// --admit hold,reserve runs every configuration under both admission
+// models for a side-by-side throughput comparison.
+// --warmup simulates the start-up transient once per configuration; each
+// run then continues from a copy of that state, so only steady-state
+// traffic is measured without paying for the warm-up in every run.
+// --spread gives every car its own crossing time around the configured
+// one; --learn and --backfill let the scheduler predict and use them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "vsim.h"
+#include "pool.h"
+#include "evlog.h"
+
+
+// Parameter range (start, stop inclusive, step)
+
+typedef struct {
+    double start;
+    double stop;
+    double step;
+    int n;
+} range;
+
+
+// One point of the parameter grid
+
+typedef struct {
+    vsim_config cfg;
+    double rate;         // arrivals per second per direction
+    int stream;          // random stream; shared across admission models
+    vsim *warm;          // state after --warmup, cloned by every run
+    int warm_cid;        // next car ID after the warm-up
+} sweep_point;
+
+
+// Shared, read-only job description plus per-job result slots
+
+typedef struct {
+    sweep_point *points;
+    int npoints;
+    int reps;
+    double horizon;      // seconds of arrivals per run
+    double warmup;       // seconds of arrivals before measuring, 0 = none
+    geom geom;
+    uint64_t seed;
+    vsim_stats *results; // npoints * reps
+    const char *trace_path;  // timeline of the first run, or NULL
+    const char *events_path; // binary event log of the first run, or NULL
+    const char *results_path;  // per-car columns of the first run, or NULL
+    atomic_int next_job;
+} sweep_jobs;
+
+
+// Largest time or rate accepted; keeps microseconds well inside int64_t
+
+#define MAX_VALUE 1e9
+
+
+// Most worker threads --jobs may ask for
+
+#define MAX_WORKERS 4096
+
+
+// Parses a number in 0..MAX_VALUE at s, leaving *end after it
+
+static int parse_part(const char *s, char **end, double *v) {
+    *v = strtod(s, end);
+    if (*end == s || !(*v >= 0) || *v > MAX_VALUE) return -1;
+    return 0;
+}
+
+
+// Parses a whole value that is a number in 0..MAX_VALUE
+
+static int parse_value(const char *s, double *v) {
+    char *end;
+    if (parse_part(s, &end, v) != 0 || *end) return -1;
+    return 0;
+}
+
+
+// Parses a whole value that is an integer in lo..hi
+
+static int parse_count(const char *s, long lo, long hi, int *v) {
+    char *end;
+    errno = 0;
+    long x = strtol(s, &end, 10);
+    if (end == s || *end || errno || x < lo || x > hi) return -1;
+    *v = (int)x;
+    return 0;
+}
+
+
+// Parses "v" or "a:b:step", nothing after it
+
+static int parse_range(const char *s, range *r) {
+    char *end;
+    if (parse_part(s, &end, &r->start) != 0) return -1;
+    if (*end == 0) {
+        r->stop = r->start;
+        r->step = 1;
+    } else if (*end != ':' || parse_part(end + 1, &end, &r->stop) != 0 ||
+               *end != ':' || parse_part(end + 1, &end, &r->step) != 0 ||
+               *end || r->step <= 0 || r->stop < r->start) {
+        return -1;
+    }
+    double n = floor((r->stop - r->start) / r->step + 1e-9) + 1;
+    if (n > INT_MAX) return -1;
+    r->n = (int)n;
+    return 0;
+}
+
+
+// *n times k, failing if the product leaves room for fewer than
+// slack job numbers below INT_MAX
+
+static int grow_jobs(size_t *n, size_t k, size_t slack) {
+    if (k && *n > ((size_t)INT_MAX - slack) / k) return -1;
+    *n *= k;
+    return 0;
+}
+
+static double range_at(const range *r, int i) {
+    return r->start + i * r->step;
+}
+
+
+// splitmix64 random generator, one state per run
+
+static uint64_t rng_next(uint64_t *s) {
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double rng_uniform(uint64_t *s) {
+    return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+// Poisson arrivals on each leg from the current time for `horizon`
+// seconds, target uniform over the leg's allowed movements. Cars are fed
+// in time order while the simulation advances, so only cars still in the
+// intersection are held in memory. Returns the next unused car ID.
+
+static int drive_arrivals(vsim *sim, const geom *g, double rate, double horizon,
+                          uint64_t *rng, int cid) {
+    double start = vsim_now(sim) / 1e6;
+    double next[GEOM_MAX_LEGS];
+
+    for (int d = 0; d < g->nlegs; d++)
+        next[d] = start - log(1.0 - rng_uniform(rng)) / rate;
+
+    for (;;) {
+        int d = 0;
+        for (int k = 1; k < g->nlegs; k++)
+            if (next[k] < next[d]) d = k;
+        double t = next[d];
+        if (t >= start + horizon) break;
+        next[d] = t - log(1.0 - rng_uniform(rng)) / rate;
+
+        int targets[GEOM_MAX_LEGS], n = 0;
+        for (int k = 0; k < g->nlegs; k++)
+            if (g->move_turn[d][k] != TURN_NONE) targets[n++] = k;
+        if (n == 0) continue;
+        int tgt = targets[rng_next(rng) % n];
+
+        int64_t at = (int64_t)(t * 1e6);
+        vsim_submit_car(sim, cid++, at, g->leg_sym[d], g->leg_sym[tgt]);
+        vsim_advance(sim, at);
+    }
+    return cid;
+}
+
+
+// Warm-up: one run per configuration, stopped with its queues full at
+// the end of the warm-up arrivals. The reps of that configuration all
+// continue from a copy of it, so the warm-up is simulated once instead
+// of once per run.
+
+static void *warm_worker(void *arg) {
+    sweep_jobs *jobs = (sweep_jobs*)arg;
+
+    for (;;) {
+        int p = atomic_fetch_add(&jobs->next_job, 1);
+        if (p >= jobs->npoints) break;
+
+        sweep_point *pt = &jobs->points[p];
+        uint64_t rng = jobs->seed ^ (0xd1b54a32d192ed03ULL * ((uint64_t)pt->stream + 1));
+        pt->warm = vsim_create(&pt->cfg);
+        if (pt->warm)
+            pt->warm_cid = drive_arrivals(pt->warm, &jobs->geom, pt->rate,
+                                          jobs->warmup, &rng, 1);
+    }
+    return NULL;
+}
+
+
+// Appends one decision to a binary event log
+
+static void log_event(const vsim_event *ev, void *user) {
+    evlog_rec rec = { ev->time, ev->cid, (uint8_t)ev->type, ev->orig, ev->target, 0 };
+    fwrite(&rec, sizeof(rec), 1, (FILE*)user);
+}
+
+
+static FILE *open_events(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fwrite(EVLOG_MAGIC, 1, EVLOG_MAGIC_LEN, f);
+    return f;
+}
+
+
+static void *sweep_worker(void *arg) {
+    sweep_jobs *jobs = (sweep_jobs*)arg;
+    int total = jobs->npoints * jobs->reps;
+
+    for (;;) {
+        int j = atomic_fetch_add(&jobs->next_job, 1);
+        if (j >= total) break;
+
+        const sweep_point *pt = &jobs->points[j / jobs->reps];
+        uint64_t k = (uint64_t)pt->stream * jobs->reps + j % jobs->reps;
+        uint64_t rng = jobs->seed ^ (0x632be59bd9b4e019ULL * (k + 1));
+
+        // crossing times differ per run, as arrivals do; a run from a
+        // warm-up shares only the cars already in the warm state
+        vsim_config cfg = pt->cfg;
+        cfg.cross_seed = jobs->seed ^ (0xc2b2ae3d27d4eb4fULL * (k + 1));
+        vsim *sim = pt->warm ? vsim_clone(pt->warm) : vsim_create(&cfg);
+        if (!sim) continue;
+        if (pt->warm) {
+            vsim_reseed(sim, cfg.cross_seed);
+            vsim_reset_stats(sim);
+        }
+        if (j == 0 && jobs->trace_path) vsim_enable_trace(sim);
+        FILE *events = j == 0 && jobs->events_path ? open_events(jobs->events_path) : NULL;
+        if (events) vsim_set_callback(sim, log_event, events);
+        if (j == 0 && jobs->results_path) vsim_open_results(sim, jobs->results_path);
+        drive_arrivals(sim, &jobs->geom, pt->rate, jobs->horizon, &rng,
+                       pt->warm ? pt->warm_cid : 1);
+        vsim_run(sim);
+        if (j == 0 && jobs->trace_path) vsim_write_trace(sim, jobs->trace_path);
+        if (events && fclose(events) != 0) perror(jobs->events_path);
+        if (j == 0 && jobs->results_path && vsim_close_results(sim) != 0)
+            fprintf(stderr, "%s: write failed\n", jobs->results_path);
+        vsim_get_stats(sim, &jobs->results[j]);
+        vsim_destroy(sim);
+    }
+    pool_trim_thread_cache();
+    return NULL;
+}
+
+
+static void run_workers(void *(*fn)(void*), sweep_jobs *jobs, int nworkers) {
+    pthread_t *threads = malloc(nworkers * sizeof(pthread_t));
+    for (int i = 0; i < nworkers; i++)
+        pthread_create(&threads[i], NULL, fn, jobs);
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+
+static void write_csv(FILE *out, const sweep_jobs *jobs) {
+    fprintf(out, "stop_time,delta_l,delta_s,delta_r,rate,admit,reps,cars,"
+                 "throughput_mean,throughput_sd,latency_mean,latency_p95,"
+                 "latency_max,delay_mean,wait_max,latency_p50,latency_p99,"
+                 "minute_min,minute_max,backfills,overruns\n");
+
+    for (int p = 0; p < jobs->npoints; p++) {
+        const sweep_point *pt = &jobs->points[p];
+        const vsim_stats *r = &jobs->results[p * jobs->reps];
+        double cars = 0, tp = 0, tp2 = 0, lat = 0, p95 = 0, mx = 0, dl = 0, wmx = 0;
+        double p50 = 0, p99 = 0, bf = 0, ov = 0;
+        int mmin = r[0].minute_min, mmax = 0;
+
+        for (int k = 0; k < jobs->reps; k++) {
+            cars += r[k].cars;
+            tp   += r[k].throughput;
+            tp2  += r[k].throughput * r[k].throughput;
+            lat  += r[k].mean_latency;
+            p95  += r[k].p95_latency;
+            dl   += r[k].mean_delay;
+            if (r[k].max_latency > mx) mx = r[k].max_latency;
+            if (r[k].max_wait > wmx) wmx = r[k].max_wait;
+            p50  += r[k].p50_latency;
+            p99  += r[k].p99_latency;
+            if (r[k].minute_min < mmin) mmin = r[k].minute_min;
+            if (r[k].minute_max > mmax) mmax = r[k].minute_max;
+            bf   += r[k].backfills;
+            ov   += r[k].overruns;
+        }
+        int n = jobs->reps;
+        double mean = tp / n;
+        double var = n > 1 ? (tp2 - n * mean * mean) / (n - 1) : 0;
+
+        fprintf(out, "%.3f,%.3f,%.3f,%.3f,%.3f,%s,%d,%.1f,%.5f,%.5f,%.4f,%.4f,%.4f,%.4f,%.4f,"
+                     "%.4f,%.4f,%d,%d,%.1f,%.1f\n",
+                pt->cfg.stop_time / 1e6, pt->cfg.delta_l / 1e6,
+                pt->cfg.delta_s / 1e6, pt->cfg.delta_r / 1e6, pt->rate,
+                pt->cfg.admit == ADMIT_RESERVE ? "reserve" : "hold", n,
+                cars / n, mean, var > 0 ? sqrt(var) : 0,
+                lat / n, p95 / n, mx, dl / n, wmx, p50 / n, p99 / n, mmin, mmax,
+                bf / n, ov / n);
+    }
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --stop R      stop time, seconds          (default 2)\n"
+        "  --dl R        left turn time, seconds     (default 5)\n"
+        "  --ds R        straight time, seconds      (default 4)\n"
+        "  --dr R        right turn time, seconds    (default 3)\n"
+        "  --rate R      arrivals/s per direction    (default 0.1)\n"
+        "  --reps N      runs per configuration      (default 100)\n"
+        "  --horizon S   seconds of arrivals per run (default 600)\n"
+        "  --warmup S    seconds simulated once per configuration and\n"
+        "                not measured; runs start from its state (default 0)\n"
+        "  --jobs N      worker threads              (default: all cores)\n"
+        "  --seed N      base random seed            (default 1)\n"
+        "  --geom FILE   intersection geometry       (default 4-way)\n"
+        "  --admit LIST  hold, reserve or hold,reserve (default hold)\n"
+        "  --margin S    reservation slack per cell  (default 0.5)\n"
+        "  --platoon S   platoon headway, hold mode  (default 0 = off)\n"
+        "  --max-batch N cars per leg per cell share (default 0 = no limit)\n"
+        "  --max-age S   seconds per leg per share   (default 0 = no limit)\n"
+        "  --spread X    relative spread of actual crossing times\n"
+        "                around --dl/--ds/--dr       (default 0 = fixed)\n"
+        "  --learn       predict crossing times from observed ones\n"
+        "  --backfill    hold mode: admit cars predicted not to delay\n"
+        "                earlier waiting cars\n"
+        "  --out FILE    CSV output                  (default stdout)\n"
+        "  --trace FILE  Chrome trace JSON of the first run\n"
+        "  --events FILE binary event log of the first run, for validate\n"
+        "  --results FILE per-car columns of the first run (see cols.h)\n"
+        "R is a value or start:stop:step\n", prog);
+}
+
+
+int main(int argc, char **argv) {
+    range r_stop, r_dl, r_ds, r_dr, r_rate;
+    parse_range("2", &r_stop);
+    parse_range("5", &r_dl);
+    parse_range("4", &r_ds);
+    parse_range("3", &r_dr);
+    parse_range("0.1", &r_rate);
+
+    int reps = 100;
+    int nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double horizon = 600;
+    double warmup = 0;
+    uint64_t seed = 1;
+    const char *out_path = NULL;
+    const char *geom_path = NULL;
+    const char *trace_path = NULL;
+    const char *events_path = NULL;
+    const char *results_path = NULL;
+    int admits[2] = { ADMIT_HOLD }, nadmit = 1;
+    double margin = 0.5;
+    double headway = 0;
+    int max_batch = 0;
+    double max_age = 0;
+    double spread = 0;
+    int learn = 0, backfill = 0;
+
+    static struct option opts[] = {
+        { "stop",    required_argument, 0, 's' },
+        { "dl",      required_argument, 0, 'l' },
+        { "ds",      required_argument, 0, 'S' },
+        { "dr",      required_argument, 0, 'r' },
+        { "rate",    required_argument, 0, 'a' },
+        { "reps",    required_argument, 0, 'n' },
+        { "horizon", required_argument, 0, 'T' },
+        { "warmup",  required_argument, 0, 'W' },
+        { "jobs",    required_argument, 0, 'j' },
+        { "seed",    required_argument, 0, 'x' },
+        { "out",     required_argument, 0, 'o' },
+        { "geom",    required_argument, 0, 'g' },
+        { "admit",   required_argument, 0, 'A' },
+        { "margin",  required_argument, 0, 'm' },
+        { "platoon", required_argument, 0, 'P' },
+        { "max-batch", required_argument, 0, 'B' },
+        { "max-age", required_argument, 0, 'G' },
+        { "spread",  required_argument, 0, 'V' },
+        { "learn",   no_argument,       0, 'L' },
+        { "backfill", no_argument,      0, 'F' },
+        { "trace",   required_argument, 0, 't' },
+        { "events",  required_argument, 0, 'E' },
+        { "results", required_argument, 0, 'R' },
+        { "help",    no_argument,       0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "s:l:S:r:a:n:T:W:j:x:o:g:A:m:P:B:G:V:LFt:E:R:h", opts, NULL)) != -1) {
+        int bad = 0;
+        switch (c) {
+            case 's': bad = parse_range(optarg, &r_stop); break;
+            case 'l': bad = parse_range(optarg, &r_dl);   break;
+            case 'S': bad = parse_range(optarg, &r_ds);   break;
+            case 'r': bad = parse_range(optarg, &r_dr);   break;
+            case 'a': bad = parse_range(optarg, &r_rate); break;
+            case 'n': bad = parse_count(optarg, 1, INT_MAX, &reps);  break;
+            case 'T': bad = parse_value(optarg, &horizon);  break;
+            case 'W': bad = parse_value(optarg, &warmup);   break;
+            case 'j': bad = parse_count(optarg, 1, MAX_WORKERS, &nworkers); break;
+            case 'x': {
+                char *end;
+                errno = 0;
+                seed = strtoull(optarg, &end, 10);
+                bad = end == optarg || *end || errno || optarg[0] == '-';
+                break;
+            }
+            case 'o': out_path = optarg;                  break;
+            case 'g': geom_path = optarg;                 break;
+            case 't': trace_path = optarg;                break;
+            case 'E': events_path = optarg;               break;
+            case 'R': results_path = optarg;              break;
+            case 'm': bad = parse_value(optarg, &margin);   break;
+            case 'P': bad = parse_value(optarg, &headway);  break;
+            case 'B': bad = parse_count(optarg, 0, INT_MAX, &max_batch); break;
+            case 'G': bad = parse_value(optarg, &max_age);  break;
+            case 'V': bad = parse_value(optarg, &spread);   break;
+            case 'L': learn = 1;                          break;
+            case 'F': backfill = 1;                       break;
+            case 'A':
+                if (!strcmp(optarg, "hold")) {
+                    admits[0] = ADMIT_HOLD; nadmit = 1;
+                } else if (!strcmp(optarg, "reserve")) {
+                    admits[0] = ADMIT_RESERVE; nadmit = 1;
+                } else if (!strcmp(optarg, "hold,reserve")) {
+                    admits[0] = ADMIT_HOLD; admits[1] = ADMIT_RESERVE; nadmit = 2;
+                } else {
+                    bad = 1;
+                }
+                break;
+            default:  usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+        if (bad) {
+            fprintf(stderr, "bad value: %s\n", optarg);
+            return 1;
+        }
+    }
+    if (horizon <= 0 || r_rate.start <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+    // jobs are numbered with an int, and each worker takes one number
+    // past the last job before it stops
+    size_t npoints = 1;
+    size_t njobs;
+    int big = grow_jobs(&npoints, r_stop.n, MAX_WORKERS) ||
+              grow_jobs(&npoints, r_dl.n, MAX_WORKERS) ||
+              grow_jobs(&npoints, r_ds.n, MAX_WORKERS) ||
+              grow_jobs(&npoints, r_dr.n, MAX_WORKERS) ||
+              grow_jobs(&npoints, r_rate.n, MAX_WORKERS) ||
+              grow_jobs(&npoints, nadmit, MAX_WORKERS);
+    njobs = npoints;
+    if (big || grow_jobs(&njobs, reps, MAX_WORKERS)) {
+        fprintf(stderr, "too many runs\n");
+        return 1;
+    }
+
+    sweep_jobs jobs;
+    jobs.npoints = (int)npoints;
+    jobs.reps = reps;
+    jobs.horizon = horizon;
+    jobs.warmup = warmup;
+    jobs.seed = seed;
+    jobs.trace_path = trace_path;
+    jobs.events_path = events_path;
+    jobs.results_path = results_path;
+    if (geom_path) {
+        if (geom_load(&jobs.geom, geom_path) != 0) return 1;
+    } else {
+        geom_default(&jobs.geom);
+    }
+    jobs.points = calloc(npoints, sizeof(sweep_point));
+    jobs.results = calloc(njobs, sizeof(vsim_stats));
+    atomic_init(&jobs.next_job, 0);
+    if (!jobs.points || !jobs.results) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    int p = 0;
+    for (int a = 0; a < r_stop.n; a++)
+    for (int b = 0; b < r_dl.n; b++)
+    for (int s = 0; s < r_ds.n; s++)
+    for (int d = 0; d < r_dr.n; d++)
+    for (int e = 0; e < r_rate.n; e++)
+    for (int m = 0; m < nadmit; m++) {
+        sweep_point *pt = &jobs.points[p++];
+        pt->cfg.stop_time = (int64_t)(range_at(&r_stop, a) * 1e6);
+        pt->cfg.delta_l   = (int64_t)(range_at(&r_dl, b) * 1e6);
+        pt->cfg.delta_s   = (int64_t)(range_at(&r_ds, s) * 1e6);
+        pt->cfg.delta_r   = (int64_t)(range_at(&r_dr, d) * 1e6);
+        pt->rate          = range_at(&r_rate, e);
+        pt->cfg.geom      = &jobs.geom;
+        pt->cfg.admit     = admits[m];
+        pt->stream        = (p - 1) / nadmit;
+        pt->cfg.reserve_margin = (int64_t)(margin * 1e6);
+        pt->cfg.platoon_headway = (int64_t)(headway * 1e6);
+        pt->cfg.share_max_batch = max_batch;
+        pt->cfg.share_max_age   = (int64_t)(max_age * 1e6);
+        pt->cfg.cross_spread = spread;
+        pt->cfg.cross_seed   = seed ^ (0x9e6c63d0676a9a99ULL * ((uint64_t)pt->stream + 1));
+        pt->cfg.cross_learn  = learn;
+        pt->cfg.backfill     = backfill;
+    }
+
+    if (warmup > 0) {
+        run_workers(warm_worker, &jobs, nworkers < jobs.npoints ? nworkers : jobs.npoints);
+        atomic_store(&jobs.next_job, 0);
+    }
+    if ((size_t)nworkers > njobs) nworkers = (int)njobs;
+    run_workers(sweep_worker, &jobs, nworkers);
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        perror(out_path);
+        return 1;
+    }
+    write_csv(out, &jobs);
+    if (out != stdout) fclose(out);
+
+    for (int i = 0; i < jobs.npoints; i++)
+        vsim_destroy(jobs.points[i].warm);
+    free(jobs.points);
+    free(jobs.results);
+    return 0;
+}
@@ -1,11 +1,26 @@
+#define _GNU_SOURCE     // sched_getcpu
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sched.h>
+#include "tc.h"
+#include "geom.h"
+#include "resv.h"
+#include "metrics.h"
+#include "trace.h"
+#include "cols.h"
+#include "ostats.h"
+#include "prof.h"
 
 
-// Time constants (microseconds)
+// Default time constants (microseconds), overridable via tc_config
 
 #define STOP_TIME 2000000     // 2-second stop
 #define DELTA_L   5000000     // left turn time
@@ -13,348 +28,1446 @@
 #define DELTA_R   3000000     // right turn time
 
 
-// Direction indices
+// Cars per arena chunk; chunks never move once allocated
 
-#define DIR_N 0
-#define DIR_S 1
-#define DIR_E 2
-#define DIR_W 3
+#define CAR_CHUNK 256
+#define CAR_STACK (64 * 1024)
 
 
-// Quadrant indices
+// Quadrant word, updated by compare-and-swap so that compatible cars
+// take and release quadrants without a lock:
+//   bits  0..11  cars inside (0 = free, other fields then stale)
+//   bits 12..23  cars admitted since the current key took it (saturates)
+//   bits 24..31  sharing key of the cars inside, see geom_key()
+//   bits 32..63  when that key took it, ms since start
 
-#define Q_NW 0
-#define Q_NE 1
-#define Q_SW 2
-#define Q_SE 3
-#define NUM_QUADS 4
-#define NUM_CARS 8
+typedef _Atomic uint64_t quadrant_t;
 
+#define QW_MAX       0xfff
+#define QW_COUNT(w)  ((int)((w) & QW_MAX))
+#define QW_BATCH(w)  ((int)(((w) >> 12) & QW_MAX))
+#define QW_KEY(w)    ((int)(((w) >> 24) & 0xff))
+#define QW_EPOCH(w)  ((int64_t)((w) >> 32))
+#define QW_MAKE(count, batch, key, epoch) \
+    ((uint64_t)(count) | (uint64_t)(batch) << 12 | \
+     (uint64_t)(key) << 24 | (uint64_t)(epoch) << 32)
 
-// Direction pair for each car
+
+// Car waiting for its whole path; lives on the car's stack. The car
+// that grants it takes the cells on its behalf and signals, all under
+// cell_lock.
+
+typedef struct cell_waiter cell_waiter;
+
+struct cell_waiter {
+    cell_waiter *next;
+    geom_mask mask;
+    int key;
+    int granted;
+    uint64_t grant_tick; // prof_now() at the grant, when profiling
+    pthread_cond_t cond;
+};
+
+
+// Head-of-line order per lane. Cars take a ticket on arrival and become
+// the lane head strictly in ticket order; the head hands the lane to the
+// holder of the next ticket, waking only that car. A car waiting its
+// turn parks a lane_waiter on its stack.
+
+typedef struct lane_waiter lane_waiter;
+
+struct lane_waiter {
+    lane_waiter *next;
+    uint64_t ticket;
+    int ready;
+    uint64_t ready_tick; // prof_now() at the handoff, when profiling
+    pthread_cond_t cond;
+};
 
 typedef struct {
-    char dir_original;
-    char dir_target;
-} directions;
+    pthread_mutex_t lock;    // protects serving and parked
+    atomic_ullong next;      // next ticket to hand out
+    uint64_t serving;        // ticket of the lane head
+    lane_waiter *parked;     // cars waiting their turn, any order
+} lane_queue;
 
 
-// Per-car state tracking
+// Arena slot: car state plus its thread
 
 typedef struct {
-    int cid;                // car ID
-    double arrival_time;    // scheduled arrival
-    directions dir;         // original + target directions
-    double stop_complete_time;
-    int at_front;           // is at front of lane?
-    int waiting;            // waiting at stop sign?
-    int crossing;           // currently in intersection?
-    int done;               // finished crossing?
-} car_info;
+    car_info car;        // first, so a car_info* is its slot
+    pthread_t thread;
+    tc_sim *sim;
+    trace_car trace;     // phase timestamps, written by the car's thread
+    uint64_t ticket;     // place in its lane, see lane_queue
+    prof_car *prof;      // phase ticks if sampled, else NULL
+} car_slot;
+
+
+// Admission rate window for the metrics exporter, seconds
+
+#define RATE_WINDOW 10
 
+// Queue-length moving average time constant, microseconds
+#define QUEUE_TAU 60e6
 
-// Quadrant lock supporting same-direction sharing
+
+// Statistics shard: hot-path event counters, lane depths and the wait
+// and latency histograms. Each car has its own thread, far more threads
+// than CPUs, so shards go by the CPU a thread runs on: threads that
+// write the same shard mostly take turns on one CPU rather than
+// bouncing its cache lines between CPUs. Adds are relaxed atomics,
+// since a thread can migrate between choosing a shard and writing it.
+// Shards are cache-line aligned and readers sum all of them on demand.
+// Beyond STAT_SHARDS CPUs, CPUs share shards.
+
+#define STAT_SHARDS 16
+
+enum {
+    CT_ADMITTED,         // cars that entered the intersection
+    CT_EXITED,
+    CT_LANE_WAITS,       // lane head busy after the stop
+    CT_CELL_WAITS,       // path acquisitions that queued
+    CT_WAKEUPS,          // earlier-car waits woken in ArriveIntersection
+    CT_SPURIOUS,         // of those, woken with an earlier car still waiting
+    CT_COUNT
+};
 
 typedef struct {
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    int owner_dir;   // -1 = free, otherwise direction ID
-    int count;       // number of cars from same direction
-} quadrant_t;
+    _Alignas(64) atomic_long count[CT_COUNT];
+    atomic_int depth[GEOM_LANE_SLOTS];  // arrivals minus entries per lane
+    metrics_hist wait;   // stop complete -> entry
+    ohist lat;           // arrival -> exit, microseconds
+} stat_shard;
+
+
+// Profiler frames, one per phase a sampled car can be in. The first
+// level of each stack says what the time went to: model (stop sign,
+// crossing, planned slot or headway), wait (for other cars), sync
+// (locks, atomics and wake-ups: the simulator's own overhead) or io
+// (event output).
+
+enum {
+    PF_ARRIVE_PRINT, PF_TICKET, PF_STOP, PF_STOP_DONE, PF_LANE_WAIT,
+    PF_LANE, PF_AT_FRONT, PF_YIELD_SCAN, PF_YIELD_WAIT,
+    PF_PLAN, PF_RESERVE, PF_SLOT, PF_CELLS, PF_ROLLBACK, PF_CELL_LOCK,
+    PF_CELL_WAIT, PF_CELL_HANDOFF, PF_HEADWAY, PF_ADMIT, PF_CROSS_PRINT,
+    PF_LANE_LEAVE, PF_DRIVE, PF_OBSERVE, PF_RELEASE,
+    PF_EXIT_PRINT, PF_EXIT,
+    PF_QUAD,             // + cell: taking that quadrant
+    PF_COUNT = PF_QUAD + GEOM_MAX_CELLS
+};
+
+_Static_assert(PF_COUNT <= PROF_MAX_FRAMES, "profiler frames");
+
+static const char *const pf_stack[PF_QUAD] = {
+    [PF_ARRIVE_PRINT] = "io;arrive;print",
+    [PF_TICKET]       = "sync;arrive;ticket",
+    [PF_STOP]         = "model;arrive;stop",
+    [PF_STOP_DONE]    = "sync;arrive;stop_done",
+    [PF_LANE_WAIT]    = "wait;arrive;lane",
+    [PF_LANE]         = "sync;arrive;lane",
+    [PF_AT_FRONT]     = "sync;arrive;at_front",
+    [PF_YIELD_SCAN]   = "sync;arrive;yield_scan",
+    [PF_YIELD_WAIT]   = "wait;arrive;yield",
+    [PF_PLAN]         = "sync;cross;plan",
+    [PF_RESERVE]      = "sync;cross;reserve",
+    [PF_SLOT]         = "model;cross;slot",
+    [PF_CELLS]        = "sync;cross;cells",
+    [PF_ROLLBACK]     = "sync;cross;cells;rollback",
+    [PF_CELL_LOCK]    = "sync;cross;cell_lock",
+    [PF_CELL_WAIT]    = "wait;cross;cells",
+    [PF_CELL_HANDOFF] = "sync;cross;cell_handoff",
+    [PF_HEADWAY]      = "model;cross;headway",
+    [PF_ADMIT]        = "sync;cross;admit",
+    [PF_CROSS_PRINT]  = "io;cross;print",
+    [PF_LANE_LEAVE]   = "sync;cross;lane_leave",
+    [PF_DRIVE]        = "model;cross;drive",
+    [PF_OBSERVE]      = "sync;cross;observe",
+    [PF_RELEASE]      = "sync;cross;release",
+    [PF_EXIT_PRINT]   = "io;exit;print",
+    [PF_EXIT]         = "sync;exit;done",
+};
+
+// The calling car thread's profile if its car is sampled
+static _Thread_local prof_car *thread_prof;
+
+
+// Chunked car storage: grows CAR_CHUNK cars at a time, addresses stable
+
+typedef struct {
+    car_slot **chunks;
+    int nchunks;
+    int chunk_cap;
+    int count;
+} car_arena;
+
+
+// Simulator context: everything one intersection needs
+
+struct tc_sim {
+    tc_config cfg;
+    geom geom;
+
+    quadrant_t quads[GEOM_MAX_CELLS];
+    pthread_mutex_t cell_lock;       // protects the wait queue
+    cell_waiter *wait_head;          // FIFO of cars waiting for cells
+    cell_waiter *wait_tail;
+    atomic_int nwaiters;             // queue length, read without the lock
+    lane_queue lanes[GEOM_LANE_SLOTS];  // head-of-line per lane
+    pthread_mutex_t state_lock;      // protects shared car state
+    pthread_cond_t state_cond;       // wake waiting cars
+    pthread_mutex_t print_lock;      // serializes output
+    pthread_mutex_t resv_lock;       // protects resv
+    resv_table resv;                 // ADMIT_RESERVE bookings
+    xt_model xt;                     // crossing times; estimates under state_lock
+
+    // platoon state per lane, protected by state_lock
+    int lane_pending[GEOM_LANE_SLOTS];   // arrived, not yet crossing
+    int plat_active[GEOM_LANE_SLOTS];    // leader still in intersection
+    int plat_cid[GEOM_LANE_SLOTS];       // that leader
+    int plat_tgt[GEOM_LANE_SLOTS];       // and its target leg
+    int64_t plat_start[GEOM_LANE_SLOTS]; // when it entered
+    car_info *lane_head[GEOM_LANE_SLOTS]; // at the front, not yet admitted
+
+    double max_wait[GEOM_MAX_LEGS];      // stop complete -> entry, state_lock
+
+    // live metrics: car paths write only their CPU's shard, the
+    // exporter thread sums the shards; rate_* belong to the exporter
+    // thread alone
+    stat_shard shards[STAT_SHARDS];  // counters, lane depth, wait and latency
+    long rate_ring[RATE_WINDOW];     // CT_ADMITTED, one sample per second
+    int rate_pos;
+    int rate_n;
+    oema queue_avg[GEOM_LANE_SLOTS]; // lane_depth(), sampled each second
+    metrics_server *metrics;
+
+    struct timeval start_time;
+    car_arena cars;
+    FILE *out;                       // NULL prints nothing
+    tc_event_fn event_fn;            // under print_lock
+    void *event_user;
+};
+
+
+// Returns car slot i
+
+static car_slot *arena_at(car_arena *a, int i) {
+    return &a->chunks[i / CAR_CHUNK][i % CAR_CHUNK];
+}
+
+
+// Reserves a new slot, adding a chunk when the last one is full
+
+static car_slot *arena_add(car_arena *a) {
+    if (a->count == a->nchunks * CAR_CHUNK) {
+        if (a->nchunks == a->chunk_cap) {
+            int ncap = a->chunk_cap ? a->chunk_cap * 2 : 8;
+            car_slot **c = realloc(a->chunks, ncap * sizeof(car_slot*));
+            if (!c) return NULL;
+            a->chunks = c;
+            a->chunk_cap = ncap;
+        }
+        a->chunks[a->nchunks] = malloc(CAR_CHUNK * sizeof(car_slot));
+        if (!a->chunks[a->nchunks]) return NULL;
+        a->nchunks++;
+    }
+    return arena_at(a, a->count++);
+}
+
+
+static void arena_free(car_arena *a) {
+    for (int i = 0; i < a->nchunks; i++)
+        free(a->chunks[i]);
+    free(a->chunks);
+    memset(a, 0, sizeof(*a));
+}
+
+
+// Shard of the CPU the caller is running on
+
+static stat_shard *my_shard(tc_sim *sim) {
+    int cpu = sched_getcpu();
+    return &sim->shards[cpu > 0 ? cpu % STAT_SHARDS : 0];
+}
+
+
+static void count_event(tc_sim *sim, int ct) {
+    atomic_fetch_add_explicit(&my_shard(sim)->count[ct], 1, memory_order_relaxed);
+}
 
 
-// Global synchronization objects
+static long count_total(tc_sim *sim, int ct) {
+    long n = 0;
+    for (int i = 0; i < STAT_SHARDS; i++)
+        n += atomic_load_explicit(&sim->shards[i].count[ct], memory_order_relaxed);
+    return n;
+}
+
 
-quadrant_t quads[NUM_QUADS];
-pthread_mutex_t dir_lock[4];     // ensures head-of-line behavior
-pthread_mutex_t state_lock;      // protects shared car state
-pthread_cond_t state_cond;       // wake waiting cars
-pthread_mutex_t print_lock;      // serializes output
+// Ends the calling car's current profiler frame
 
-struct timeval start_time;
-car_info cars[NUM_CARS];
+static void mark(int frame) {
+    if (thread_prof) prof_mark(thread_prof, frame);
+}
 
 
 // Returns seconds since simulation start
 
-double get_sim_time() {
+static double get_sim_time(tc_sim *sim) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - sim->start_time.tv_sec) +
+           (now.tv_usec - sim->start_time.tv_usec) / 1000000.0;
+}
+
+
+// Microseconds since simulation start
+
+static int64_t get_sim_usec(tc_sim *sim) {
     struct timeval now;
     gettimeofday(&now, NULL);
-    return (now.tv_sec - start_time.tv_sec) +
-           (now.tv_usec - start_time.tv_usec) / 1000000.0;
+    return (int64_t)(now.tv_sec - sim->start_time.tv_sec) * 1000000 +
+           (now.tv_usec - sim->start_time.tv_usec);
 }
 
 
 // Sleep helper
 
-void Spin(int usec) { usleep(usec); }
+static void Spin(int usec) { usleep(usec); }
 
 
-// Safe printing function
+// Safe printing function; also feeds the event callback, under the same
+// lock so that callbacks see events in printed order
 
-void print_event(int cid, char orig, char target, const char* event) {
-    pthread_mutex_lock(&print_lock);
-    printf("Time %.1f: Car %d (%c %c) %s\n",
-           get_sim_time(), cid, orig, target, event);
-    fflush(stdout);
-    pthread_mutex_unlock(&print_lock);
+static void print_event(tc_sim *sim, car_info *car, int type) {
+    static const char *const name[] = { "arriving", "crossing", "exiting" };
+    pthread_mutex_lock(&sim->print_lock);
+    tc_event ev = { get_sim_usec(sim), car->cid, type,
+                    car->dir.dir_original, car->dir.dir_target };
+    if (sim->out) {
+        fprintf(sim->out, "Time %.1f: Car %d (%c %c) %s\n",
+                ev.time / 1e6, ev.cid, ev.orig, ev.target, name[type]);
+        fflush(sim->out);
+    }
+    if (sim->event_fn)
+        sim->event_fn(&ev, sim->event_user);
+    pthread_mutex_unlock(&sim->print_lock);
 }
 
 
-// Converts character direction to index
+// Converts character direction to leg index
 
-int dir_to_index(char d) {
-    switch (d) {
-        case '^': return DIR_N;
-        case 'v': return DIR_S;
-        case '>': return DIR_E;
-        case '<': return DIR_W;
-    }
-    return -1;
+static int dir_to_index(tc_sim *sim, char d) {
+    return geom_leg(&sim->geom, d);
 }
 
 
-// Turn type: 0=straight, 1=left, 2=right
+// Turn type from the geometry: TURN_STRAIGHT, TURN_LEFT, TURN_RIGHT
 
-int get_turn_type(char orig, char target) {
-    if (orig == target) return 0;
-    if ((orig=='^' && target=='<') ||
-        (orig=='v' && target=='>') ||
-        (orig=='>' && target=='^') ||
-        (orig=='<' && target=='v'))
-        return 1;
-    return 2;
+static int get_turn_type(tc_sim *sim, char orig, char target) {
+    int o = dir_to_index(sim, orig), t = dir_to_index(sim, target);
+    if (o < 0 || t < 0) return TURN_NONE;
+    return sim->geom.move_turn[o][t];
 }
 
 
-// Returns DELTA_L, DELTA_S, DELTA_R
+// Returns configured left, straight or right crossing time
 
-int get_crossing_time(int turn) {
-    if (turn == 1) return DELTA_L;
-    if (turn == 0) return DELTA_S;
-    return DELTA_R;
+static int get_crossing_time(tc_sim *sim, int turn) {
+    if (turn == TURN_LEFT) return sim->cfg.delta_l;
+    if (turn == TURN_STRAIGHT) return sim->cfg.delta_s;
+    return sim->cfg.delta_r;
 }
 
 
-// Quadrant bitmask needed for movement
+// Lane slot serving a movement
 
-int get_quadrant_mask(char orig, char target) {
-    int turn = get_turn_type(orig, target);
-    switch (orig) {
-        case '^':
-            if (turn == 2) return (1<<Q_SW);
-            if (turn == 0) return (1<<Q_SW) | (1<<Q_NW);
-            return (1<<Q_SW) | (1<<Q_NW) | (1<<Q_NE);
-        case 'v':
-            if (turn == 2) return (1<<Q_NE);
-            if (turn == 0) return (1<<Q_NE) | (1<<Q_SE);
-            return (1<<Q_NE) | (1<<Q_SE) | (1<<Q_SW);
-        case '>':
-            if (turn == 2) return (1<<Q_NW);
-            if (turn == 0) return (1<<Q_NW) | (1<<Q_NE);
-            return (1<<Q_NW) | (1<<Q_NE) | (1<<Q_SE);
-        case '<':
-            if (turn == 2) return (1<<Q_SE);
-            if (turn == 0) return (1<<Q_SE) | (1<<Q_SW);
-            return (1<<Q_SE) | (1<<Q_SW) | (1<<Q_NW);
-    }
+static int get_lane(tc_sim *sim, char orig, char target) {
+    int o = dir_to_index(sim, orig), t = dir_to_index(sim, target);
+    return geom_lane(&sim->geom, o, t);
+}
+
+
+// Cell bitmask needed for movement
+
+static geom_mask get_quadrant_mask(tc_sim *sim, char orig, char target) {
+    int o = dir_to_index(sim, orig), t = dir_to_index(sim, target);
+    if (o < 0 || t < 0) return 0;
+    return sim->geom.move_mask[o][t];
+}
+
+
+// Owner has used up its batch or age and must drain
+
+static int quad_closed(tc_sim *sim, uint64_t w, int64_t now_ms) {
+    if (sim->cfg.share_max_batch && QW_BATCH(w) >= sim->cfg.share_max_batch)
+        return 1;
+    if (sim->cfg.share_max_age && (now_ms - QW_EPOCH(w)) * 1000 >= sim->cfg.share_max_age)
+        return 1;
     return 0;
 }
 
 
-// Quadrant acquire supporting same-direction sharing
+// Enter one quadrant with the given sharing key if it is free or held
+// by the same key and still open
+
+static int take_quad(tc_sim *sim, quadrant_t *quad, int key, int64_t now_ms) {
+    uint64_t w = atomic_load(quad);
+    for (;;) {
+        uint64_t n;
+        if (QW_COUNT(w) == 0) {
+            n = QW_MAKE(1, 1, key, now_ms);
+        } else if (QW_KEY(w) != key || QW_COUNT(w) == QW_MAX ||
+                   quad_closed(sim, w, now_ms)) {
+            return 0;
+        } else {
+            n = w + 1;
+            if (QW_BATCH(w) < QW_MAX) n += (uint64_t)1 << 12;
+        }
+        if (atomic_compare_exchange_weak(quad, &w, n))
+            return 1;
+    }
+}
 
-void acquire_quad(int q, int dir) {
-    pthread_mutex_lock(&quads[q].lock);
-    while (quads[q].owner_dir != -1 && quads[q].owner_dir != dir)
-        pthread_cond_wait(&quads[q].cond, &quads[q].lock);
-    quads[q].owner_dir = dir;
-    quads[q].count++;
-    pthread_mutex_unlock(&quads[q].lock);
+
+// Enter every quadrant in mask or none. A rolled-back attempt still
+// counts toward the batch, which only closes a quadrant a little early.
+// With p, the time for each quadrant goes to its own profiler frame.
+
+static int take_cells(tc_sim *sim, geom_mask mask, int key, prof_car *p) {
+    int64_t now_ms = get_sim_usec(sim) / 1000;
+    if (p) prof_mark(p, PF_CELLS);
+    for (geom_mask m = mask; m; m &= m - 1) {
+        int c = __builtin_ctzll(m);
+        int ok = take_quad(sim, &sim->quads[c], key, now_ms);
+        if (p) prof_mark(p, PF_QUAD + c);
+        if (ok) continue;
+        for (geom_mask r = mask & ~m; r; r &= r - 1)
+            atomic_fetch_sub(&sim->quads[__builtin_ctzll(r)], 1);
+        if (p) prof_mark(p, PF_ROLLBACK);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Grant waiters in queue order. A waiter may pass an earlier one only
+// if they share no quadrant or have the same sharing key. Caller holds
+// cell_lock.
+
+static void grant_waiters(tc_sim *sim) {
+    geom_mask ahead[GEOM_MAX_KEYS] = {0};
+    geom_mask ahead_all = 0;
+    cell_waiter **link = &sim->wait_head;
+    cell_waiter *prev = NULL;
+
+    while (*link) {
+        cell_waiter *w = *link;
+        geom_mask others = ahead_all & ~ahead[w->key];
+        if (!(w->mask & others) && take_cells(sim, w->mask, w->key, NULL)) {
+            *link = w->next;
+            if (sim->wait_tail == w) sim->wait_tail = prev;
+            atomic_fetch_sub(&sim->nwaiters, 1);
+            w->granted = 1;
+            if (sim->cfg.profile_every) w->grant_tick = prof_now();
+            pthread_cond_signal(&w->cond);
+        } else {
+            ahead[w->key] |= w->mask;
+            ahead_all |= w->mask;
+            prev = w;
+            link = &w->next;
+        }
+    }
+}
+
+
+// Profiler frames of a queued car: waiting up to the grant, then the
+// handoff (wake-up, cell_lock) until the car runs again
+
+static void profile_grant(cell_waiter *w) {
+    if (!thread_prof) return;
+    prof_mark_at(thread_prof, PF_CELL_WAIT, w->grant_tick);
+    prof_mark(thread_prof, PF_CELL_HANDOFF);
 }
 
 
-// Release quadrant ownership
+// Acquire every quadrant in mask at once, never holding some while
+// waiting for others. With nobody queued the quadrants are taken
+// lock-free; otherwise the car queues FIFO behind earlier conflicting
+// waiters. A queued car sleeps until the releasing car grants it the
+// cells and signals.
 
-void release_quad(int q) {
-    pthread_mutex_lock(&quads[q].lock);
-    quads[q].count--;
-    if (quads[q].count == 0) {
-        quads[q].owner_dir = -1;
-        pthread_cond_broadcast(&quads[q].cond);
+static void acquire_cells(tc_sim *sim, geom_mask mask, int key) {
+    if (atomic_load(&sim->nwaiters) == 0 &&
+        take_cells(sim, mask, key, thread_prof)) {
+        mark(PF_CELLS);
+        return;
     }
-    pthread_mutex_unlock(&quads[q].lock);
+
+    count_event(sim, CT_CELL_WAITS);
+    pthread_mutex_lock(&sim->cell_lock);
+    mark(PF_CELL_LOCK);
+    cell_waiter w = { NULL, mask, key, 0, 0, PTHREAD_COND_INITIALIZER };
+    if (sim->wait_tail) sim->wait_tail->next = &w;
+    else sim->wait_head = &w;
+    sim->wait_tail = &w;
+    atomic_fetch_add(&sim->nwaiters, 1);
+
+    // a release that ran before the increment above did not see us
+    grant_waiters(sim);
+    while (!w.granted)
+        pthread_cond_wait(&w.cond, &sim->cell_lock);
+    pthread_mutex_unlock(&sim->cell_lock);
+    profile_grant(&w);
+    pthread_cond_destroy(&w.cond);
 }
 
 
-// Check if earlier-arriving cars are stuck
+// Leave every quadrant in mask and hand them to waiting cars
 
-int earlier_car_waiting(car_info *car) {
-    double my_stop = car->stop_complete_time;
-    int my_dir = dir_to_index(car->dir.dir_original);
+static void release_cells(tc_sim *sim, geom_mask mask) {
+    for (geom_mask m = mask; m; m &= m - 1)
+        atomic_fetch_sub(&sim->quads[__builtin_ctzll(m)], 1);
+
+    if (atomic_load(&sim->nwaiters) > 0) {
+        pthread_mutex_lock(&sim->cell_lock);
+        grant_waiters(sim);
+        pthread_mutex_unlock(&sim->cell_lock);
+    }
+}
 
-    for (int i = 0; i < NUM_CARS; i++) {
-        if (cars[i].cid == car->cid) continue;
-        if (cars[i].done) continue;
-        int odir = dir_to_index(cars[i].dir.dir_original);
-        if (odir == my_dir) continue;
 
-        if (cars[i].stop_complete_time > 0 &&
-            cars[i].stop_complete_time < my_stop &&
-            cars[i].at_front && cars[i].waiting && !cars[i].crossing)
+// Check if earlier-arriving cars are stuck. Only a lane head can be
+// waiting at the stop line, so this looks at one car per lane, not at
+// every car. Caller holds state_lock.
+
+static int earlier_car_waiting(tc_sim *sim, car_info *car) {
+    double my_stop = car->stop_complete_time;
+    int my_dir = dir_to_index(sim, car->dir.dir_original);
+
+    for (int lane = 0; lane < GEOM_LANE_SLOTS; lane++) {
+        car_info *other = sim->lane_head[lane];
+        if (!other || other == car) continue;
+        if (dir_to_index(sim, other->dir.dir_original) == my_dir) continue;
+        if (other->stop_complete_time < my_stop)
             return 1;
     }
     return 0;
 }
 
 
-// Car arriving and waiting logic
+// Platooning applies to the hold-all model only
+
+static int platoon_on(tc_sim *sim) {
+    return sim->cfg.platoon_headway > 0 && sim->cfg.admit == ADMIT_HOLD;
+}
 
-void ArriveIntersection(car_info *car) {
-    int dir = dir_to_index(car->dir.dir_original);
-    print_event(car->cid, car->dir.dir_original, car->dir.dir_target, "arriving");
 
-    Spin(STOP_TIME);
+// Leader from this lane with the same movement still crossing?
+// Caller holds state_lock.
 
-    pthread_mutex_lock(&state_lock);
-    car->stop_complete_time = get_sim_time();
-    pthread_mutex_unlock(&state_lock);
+static int can_follow(tc_sim *sim, int lane, int tgt) {
+    return platoon_on(sim) && sim->plat_active[lane] && sim->plat_tgt[lane] == tgt;
+}
 
-    pthread_mutex_lock(&dir_lock[dir]);
 
-    pthread_mutex_lock(&state_lock);
-    car->at_front = 1;
-    car->waiting = 1;
-    pthread_cond_broadcast(&state_cond);
-    pthread_mutex_unlock(&state_lock);
+// Timeline record of a car
+
+static trace_car *car_trace(car_info *car) {
+    return &((car_slot*)car)->trace;
+}
+
+
+// Platoon mode: a lane head with the same movement as the car that
+// last entered from its lane takes the same cells while that leader
+// still holds them, skipping the queue and the earlier-car check. The
+// leader is checked again once the cells are held, since it clears
+// plat_active before releasing them; if it has gone the cells are given
+// back and the car is admitted like any other.
+
+static int follow_leader(tc_sim *sim, car_info *car, int lane, int tgt) {
+    pthread_mutex_lock(&sim->state_lock);
+    int ok = can_follow(sim, lane, tgt);
+    pthread_mutex_unlock(&sim->state_lock);
+    if (!ok) return 0;
+
+    int dir = dir_to_index(sim, car->dir.dir_original);
+    geom_mask mask = get_quadrant_mask(sim, car->dir.dir_original, car->dir.dir_target);
+    if (!take_cells(sim, mask, geom_key(&sim->geom, dir, tgt), thread_prof))
+        return 0;
+
+    pthread_mutex_lock(&sim->state_lock);
+    ok = can_follow(sim, lane, tgt);
+    pthread_mutex_unlock(&sim->state_lock);
+    if (!ok) {
+        release_cells(sim, mask);
+        return 0;
+    }
+    car_trace(car)->grant = get_sim_usec(sim);
+    return 1;
+}
+
 
+// Place in line for the lane; called once per car on arrival
+
+static uint64_t lane_ticket(tc_sim *sim, int lane) {
+    return atomic_fetch_add(&sim->lanes[lane].next, 1);
+}
+
+
+// Wait until the car holding ticket is the lane head
+
+static void lane_enter(tc_sim *sim, int lane, uint64_t ticket) {
+    lane_queue *q = &sim->lanes[lane];
+    pthread_mutex_lock(&q->lock);
+    if (q->serving != ticket) {
+        count_event(sim, CT_LANE_WAITS);
+        lane_waiter w = { q->parked, ticket, 0, 0, PTHREAD_COND_INITIALIZER };
+        q->parked = &w;
+        while (!w.ready)
+            pthread_cond_wait(&w.cond, &q->lock);
+        pthread_cond_destroy(&w.cond);
+        if (thread_prof) prof_mark_at(thread_prof, PF_LANE_WAIT, w.ready_tick);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+// The head has entered the intersection: the next ticket becomes head,
+// woken directly if it is already parked
+
+static void lane_leave(tc_sim *sim, int lane) {
+    lane_queue *q = &sim->lanes[lane];
+    pthread_mutex_lock(&q->lock);
+    q->serving++;
+    for (lane_waiter **link = &q->parked; *link; link = &(*link)->next) {
+        lane_waiter *w = *link;
+        if (w->ticket == q->serving) {
+            *link = w->next;
+            w->ready = 1;
+            if (sim->cfg.profile_every) w->ready_tick = prof_now();
+            pthread_cond_signal(&w->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+// Car arriving and waiting logic
+
+static void ArriveIntersection(tc_sim *sim, car_info *car) {
+    int lane = get_lane(sim, car->dir.dir_original, car->dir.dir_target);
+    int tgt = dir_to_index(sim, car->dir.dir_target);
+    trace_car *tr = car_trace(car);
+    tr->arrive = get_sim_usec(sim);
+    print_event(sim, car, TC_ARRIVING);
+    mark(PF_ARRIVE_PRINT);
+
+    // nobody ahead and the leader is still crossing: no stop needed
+    pthread_mutex_lock(&sim->state_lock);
+    int skip_stop = can_follow(sim, lane, tgt) && sim->lane_pending[lane] == 0;
+    sim->lane_pending[lane]++;
+    ((car_slot*)car)->ticket = lane_ticket(sim, lane);
+    pthread_mutex_unlock(&sim->state_lock);
+    atomic_fetch_add_explicit(&my_shard(sim)->depth[lane], 1, memory_order_relaxed);
+    mark(PF_TICKET);
+
+    if (!skip_stop)
+        Spin(sim->cfg.stop_time);
+    mark(PF_STOP);
+
+    pthread_mutex_lock(&sim->state_lock);
+    car->stop_complete_time = get_sim_time(sim);
+    pthread_mutex_unlock(&sim->state_lock);
+    tr->stop = get_sim_usec(sim);
+    mark(PF_STOP_DONE);
+
+    lane_enter(sim, lane, ((car_slot*)car)->ticket);
+    tr->front = get_sim_usec(sim);
+    mark(PF_LANE);
+
+    // a follower already holds its cells and only waits out its
+    // headway, so like a crossing car it does not hold up other legs
+    int follow = follow_leader(sim, car, lane, tgt);
+    pthread_mutex_lock(&sim->state_lock);
+    car->at_front = 1;
+    car->waiting = !follow;
+    car->following = follow;
+    if (!follow) sim->lane_head[lane] = car;
+    pthread_cond_broadcast(&sim->state_cond);
+    pthread_mutex_unlock(&sim->state_lock);
+    mark(PF_AT_FRONT);
+
+    // reservations are first come first served and followers share the
+    // leader's cells; neither waits on other lanes
+    if (sim->cfg.admit == ADMIT_RESERVE || car->following) return;
+
+    int woken = 0;
     while (1) {
-        pthread_mutex_lock(&state_lock);
-        int wait = earlier_car_waiting(car);
+        pthread_mutex_lock(&sim->state_lock);
+        int wait = earlier_car_waiting(sim, car);
+        if (woken) {
+            count_event(sim, CT_WAKEUPS);
+            if (wait) count_event(sim, CT_SPURIOUS);
+        }
         if (!wait) {
-            pthread_mutex_unlock(&state_lock);
+            pthread_mutex_unlock(&sim->state_lock);
+            mark(PF_YIELD_SCAN);
             break;
         }
-        pthread_cond_wait(&state_cond, &state_lock);
-        pthread_mutex_unlock(&state_lock);
+        mark(PF_YIELD_SCAN);
+        pthread_cond_wait(&sim->state_cond, &sim->state_lock);
+        mark(PF_YIELD_WAIT);
+        woken = 1;
+        pthread_mutex_unlock(&sim->state_lock);
     }
 }
 
 
 // Car crossing intersection
 
-void CrossIntersection(car_info *car) {
-    int dir = dir_to_index(car->dir.dir_original);
-    int turn = get_turn_type(car->dir.dir_original, car->dir.dir_target);
-    int cross_time = get_crossing_time(turn);
-    int mask = get_quadrant_mask(car->dir.dir_original, car->dir.dir_target);
+static void CrossIntersection(tc_sim *sim, car_info *car) {
+    int dir = dir_to_index(sim, car->dir.dir_original);
+    int lane = get_lane(sim, car->dir.dir_original, car->dir.dir_target);
+    int tgt = dir_to_index(sim, car->dir.dir_target);
+    int turn = get_turn_type(sim, car->dir.dir_original, car->dir.dir_target);
+    int nominal = get_crossing_time(sim, turn);
+    int cross_time = (int)xt_draw(&sim->xt, car->cid, nominal);
+    geom_mask mask = get_quadrant_mask(sim, car->dir.dir_original, car->dir.dir_target);
+    int reserve = sim->cfg.admit == ADMIT_RESERVE;
+    trace_car *tr = car_trace(car);
+
+    // plan with what the car is predicted to need, not what it will take
+    int64_t plan = nominal;
+    if (sim->cfg.cross_learn) {
+        pthread_mutex_lock(&sim->state_lock);
+        plan = xt_predict(&sim->xt, dir, tgt, nominal);
+        pthread_mutex_unlock(&sim->state_lock);
+    }
+    mark(PF_PLAN);
+
+    if (reserve) {
+        // crossing unbooked could run into a later car's slot, so a
+        // booking that cannot be stored is planned again a little later
+        int64_t now, start;
+        for (;;) {
+            pthread_mutex_lock(&sim->resv_lock);
+            now = get_sim_usec(sim);
+            start = resv_earliest(&sim->resv, &sim->geom, dir, tgt, now, plan);
+            int err = resv_commit(&sim->resv, &sim->geom, dir, tgt, start, plan);
+            pthread_mutex_unlock(&sim->resv_lock);
+            if (!err) break;
+            Spin(RESV_RETRY);
+        }
+        mark(PF_RESERVE);
+
+        tr->grant = now;
+        if (start > now) Spin((int)(start - now));
+        mark(PF_SLOT);
+    } else {
+        // a follower took its cells in follow_leader()
+        if (!car->following) {
+            acquire_cells(sim, mask, geom_key(&sim->geom, dir, tgt));
+            tr->grant = get_sim_usec(sim);
+        }
+        tr->cells = mask;
+    }
 
-    for (int q = 0; q < NUM_QUADS; q++)
-        if (mask & (1<<q)) acquire_quad(q, dir);
+    if (car->following) {
+        pthread_mutex_lock(&sim->state_lock);
+        int64_t start = sim->plat_start[lane] + sim->cfg.platoon_headway;
+        pthread_mutex_unlock(&sim->state_lock);
+        int64_t now = get_sim_usec(sim);
+        if (start > now) Spin((int)(start - now));
+        mark(PF_HEADWAY);
+    }
 
-    pthread_mutex_lock(&state_lock);
+    pthread_mutex_lock(&sim->state_lock);
+    double wait = get_sim_time(sim) - car->stop_complete_time;
+    if (wait > sim->max_wait[dir]) sim->max_wait[dir] = wait;
+    metrics_hist_observe(&my_shard(sim)->wait, wait);
+    count_event(sim, CT_ADMITTED);
+    atomic_fetch_sub_explicit(&my_shard(sim)->depth[lane], 1, memory_order_relaxed);
     car->waiting = 0;
     car->crossing = 1;
-    pthread_cond_broadcast(&state_cond);
-    pthread_mutex_unlock(&state_lock);
+    sim->lane_head[lane] = NULL;
+    sim->lane_pending[lane]--;
+    if (platoon_on(sim)) {
+        sim->plat_active[lane] = 1;
+        sim->plat_cid[lane] = car->cid;
+        sim->plat_tgt[lane] = tgt;
+        sim->plat_start[lane] = get_sim_usec(sim);
+    }
+    pthread_cond_broadcast(&sim->state_cond);
+    pthread_mutex_unlock(&sim->state_lock);
 
-    pthread_mutex_unlock(&dir_lock[dir]);
+    tr->cross = get_sim_usec(sim);
+    mark(PF_ADMIT);
+    print_event(sim, car, TC_CROSSING);
+    mark(PF_CROSS_PRINT);
 
-    print_event(car->cid, car->dir.dir_original, car->dir.dir_target, "crossing");
+    // after the event is out, so the log shows lane order too
+    lane_leave(sim, lane);
+    mark(PF_LANE_LEAVE);
     Spin(cross_time);
+    mark(PF_DRIVE);
 
-    pthread_mutex_lock(&state_lock);
+    pthread_mutex_lock(&sim->state_lock);
+    xt_observe(&sim->xt, dir, tgt, get_sim_usec(sim) - tr->cross);
     car->crossing = 0;
-    pthread_mutex_unlock(&state_lock);
-
-    for (int q = NUM_QUADS - 1; q >= 0; q--)
-        if (mask & (1<<q)) release_quad(q);
+    if (sim->plat_active[lane] && sim->plat_cid[lane] == car->cid)
+        sim->plat_active[lane] = 0;
+    pthread_mutex_unlock(&sim->state_lock);
+    mark(PF_OBSERVE);
+
+    if (!reserve)
+        release_cells(sim, mask);
+    tr->exit = get_sim_usec(sim);
+    mark(PF_RELEASE);
 }
 
 
 // Car exiting intersection
 
-void ExitIntersection(car_info *car) {
-    print_event(car->cid, car->dir.dir_original, car->dir.dir_target, "exiting");
+static void ExitIntersection(tc_sim *sim, car_info *car) {
+    print_event(sim, car, TC_EXITING);
+    mark(PF_EXIT_PRINT);
+
+    const trace_car *tr = car_trace(car);
+    ohist_add_shared(&my_shard(sim)->lat, tr->exit - tr->arrive);
 
-    pthread_mutex_lock(&state_lock);
+    pthread_mutex_lock(&sim->state_lock);
     car->done = 1;
+    count_event(sim, CT_EXITED);
     car->at_front = 0;
-    pthread_cond_broadcast(&state_cond);
-    pthread_mutex_unlock(&state_lock);
+    pthread_cond_broadcast(&sim->state_cond);
+    pthread_mutex_unlock(&sim->state_lock);
+    mark(PF_EXIT);
 }
 
 
 // Car thread function
 
-void* car_thread(void *arg) {
-    car_info *car = (car_info*)arg;
+static void* car_thread(void *arg) {
+    car_slot *slot = (car_slot*)arg;
+    tc_sim *sim = slot->sim;
+    car_info *car = &slot->car;
+    thread_prof = slot->prof;
 
-    while (get_sim_time() < car->arrival_time)
+    while (get_sim_time(sim) < car->arrival_time)
         usleep(1000);
+    if (thread_prof) thread_prof->last = prof_now();
 
-    ArriveIntersection(car);
-    CrossIntersection(car);
-    ExitIntersection(car);
+    ArriveIntersection(sim, car);
+    CrossIntersection(sim, car);
+    ExitIntersection(sim, car);
 
     return NULL;
 }
 
 
-// Initialize all locks and cars
+void tc_default_config(tc_config *cfg) {
+    cfg->stop_time = STOP_TIME;
+    cfg->delta_l   = DELTA_L;
+    cfg->delta_s   = DELTA_S;
+    cfg->delta_r   = DELTA_R;
+    cfg->geom      = NULL;
+    cfg->admit     = ADMIT_HOLD;
+    cfg->reserve_margin = 500000;
+    cfg->platoon_headway = 0;
+    cfg->share_max_batch = 0;
+    cfg->share_max_age   = 0;
+    cfg->cross_spread    = 0;
+    cfg->cross_learn     = 0;
+    cfg->profile_every   = 0;
+}
+
 
-void init_system() {
-    pthread_mutex_init(&print_lock, NULL);
-    pthread_mutex_init(&state_lock, NULL);
-    pthread_cond_init(&state_cond, NULL);
+// Applies one "key = value" setting; times are in seconds
 
-    for (int i = 
+int tc_config_set(tc_config *cfg, const char *key, const char *value) {
+    if (!strcmp(key, "admit")) {
+        if      (!strcmp(value, "hold"))    cfg->admit = ADMIT_HOLD;
+        else if (!strcmp(value, "reserve")) cfg->admit = ADMIT_RESERVE;
+        else return -1;
+        return 0;
+    }
 
- 0; i < 4; i++)
-        pthread_mutex_init(&dir_lock[i], NULL);
+    // the whole value must be a number, and times must fit an int of
+    // microseconds (under 2147 s)
+    char *end;
+    double v = strtod(value, &end);
+    if (end == value || *end != 0 || !(v >= 0) || v > INT_MAX) return -1;
 
-    for (int q = 0; q < NUM_QUADS; q++) {
-        pthread_mutex_init(&quads[q].lock, NULL);
-        pthread_cond_init(&quads[q].cond, NULL);
-        quads[q].owner_dir = -1;
-        quads[q].count = 0;
+    if (!strcmp(key, "share_max_batch")) {
+        cfg->share_max_batch = (int)v;
+        return 0;
     }
+    if (!strcmp(key, "profile_every")) {
+        cfg->profile_every = (int)v;
+        return 0;
+    }
+    if (!strcmp(key, "cross_spread")) {
+        cfg->cross_spread = v;
+        return 0;
+    }
+    if (!strcmp(key, "cross_learn")) {
+        cfg->cross_learn = v != 0;
+        return 0;
+    }
+
+    if (v * 1e6 > INT_MAX) return -1;
+    if      (!strcmp(key, "stop_time")) cfg->stop_time = (int)(v * 1e6);
+    else if (!strcmp(key, "delta_l"))   cfg->delta_l   = (int)(v * 1e6);
+    else if (!strcmp(key, "delta_s"))   cfg->delta_s   = (int)(v * 1e6);
+    else if (!strcmp(key, "delta_r"))   cfg->delta_r   = (int)(v * 1e6);
+    else if (!strcmp(key, "reserve_margin")) cfg->reserve_margin = (int)(v * 1e6);
+    else if (!strcmp(key, "platoon_headway")) cfg->platoon_headway = (int)(v * 1e6);
+    else if (!strcmp(key, "share_max_age"))   cfg->share_max_age   = (int)(v * 1e6);
+    else return -1;
+    return 0;
+}
+
+
+// Create a simulator with its own locks and an empty car arena
+
+tc_sim *tc_create(const tc_config *cfg) {
+    // the statistics shards are cache-line aligned
+    tc_sim *sim = aligned_alloc(_Alignof(tc_sim), sizeof(tc_sim));
+    if (!sim) return NULL;
+    memset(sim, 0, sizeof(*sim));
+
+    if (cfg) sim->cfg = *cfg;
+    else tc_default_config(&sim->cfg);
+    if (sim->cfg.geom) sim->geom = *sim->cfg.geom;
+    else geom_default(&sim->geom);
+    sim->cfg.geom = &sim->geom;
+    sim->out = stdout;
+
+    pthread_mutex_init(&sim->print_lock, NULL);
+    pthread_mutex_init(&sim->resv_lock, NULL);
+    resv_init(&sim->resv, sim->cfg.reserve_margin);
+    xt_init(&sim->xt, sim->cfg.cross_spread, 1, sim->cfg.cross_learn);
+    for (int l = 0; l < GEOM_LANE_SLOTS; l++)
+        oema_init(&sim->queue_avg[l], QUEUE_TAU);
+    pthread_mutex_init(&sim->state_lock, NULL);
+    pthread_cond_init(&sim->state_cond, NULL);
+
+    for (int i = 0; i < GEOM_LANE_SLOTS; i++) {
+        pthread_mutex_init(&sim->lanes[i].lock, NULL);
+        atomic_init(&sim->lanes[i].next, 0);
+    }
+
+    pthread_mutex_init(&sim->cell_lock, NULL);
+    atomic_init(&sim->nwaiters, 0);
+    for (int q = 0; q < GEOM_MAX_CELLS; q++)
+        atomic_init(&sim->quads[q], 0);
+    return sim;
+}
+
+
+// Tear down locks and free the context
+
+void tc_destroy(tc_sim *sim) {
+    if (!sim) return;
+    metrics_stop(sim->metrics);
+
+    pthread_mutex_destroy(&sim->print_lock);
+    pthread_mutex_destroy(&sim->resv_lock);
+    resv_free(&sim->resv);
+    pthread_mutex_destroy(&sim->state_lock);
+    pthread_cond_destroy(&sim->state_cond);
+
+    for (int i = 0; i < GEOM_LANE_SLOTS; i++)
+        pthread_mutex_destroy(&sim->lanes[i].lock);
+
+    pthread_mutex_destroy(&sim->cell_lock);
+    for (int i = 0; i < sim->cars.count; i++)
+        free(arena_at(&sim->cars, i)->prof);
+    arena_free(&sim->cars);
+    free(sim);
+}
+
+
+int tc_add_car(tc_sim *sim, const car_info *car) {
+    if (get_turn_type(sim, car->dir.dir_original, car->dir.dir_target) == TURN_NONE)
+        return -1;
+
+    // every profile_every-th car added, from the first; a car whose
+    // profile cannot be allocated is just not sampled
+    int every = sim->cfg.profile_every;
+    int sampled = every > 0 && sim->cars.count % every == 0;
+
+    car_slot *slot = arena_add(&sim->cars);
+    if (!slot) return -1;
+    slot->car = *car;
+    slot->sim = sim;
+    slot->prof = sampled ? calloc(1, sizeof(prof_car)) : NULL;
+    slot->trace = (trace_car){ car->cid, car->dir.dir_original, car->dir.dir_target,
+                               -1, -1, -1, -1, -1, -1, 0 };
+    return 0;
+}
+
+
+int tc_num_cars(const tc_sim *sim) {
+    return sim->cars.count;
+}
+
+
+void tc_set_output(tc_sim *sim, FILE *out) {
+    sim->out = out;
+}
+
+
+void tc_set_callback(tc_sim *sim, tc_event_fn fn, void *user) {
+    sim->event_fn = fn;
+    sim->event_user = user;
+}
+
+
+double tc_max_wait(tc_sim *sim, int leg) {
+    double w = 0;
+    pthread_mutex_lock(&sim->state_lock);
+    for (int d = 0; d < sim->geom.nlegs; d++)
+        if ((leg < 0 || d == leg) && sim->max_wait[d] > w) w = sim->max_wait[d];
+    pthread_mutex_unlock(&sim->state_lock);
+    return w;
+}
+
+
+int tc_write_trace(tc_sim *sim, const char *path) {
+    FILE *f = trace_begin(path, &sim->geom);
+    if (!f) return -1;
+    for (int i = 0; i < sim->cars.count; i++)
+        trace_add(f, &arena_at(&sim->cars, i)->trace);
+    return trace_end(f);
+}
+
+
+int tc_write_results(tc_sim *sim, const char *path) {
+    cols_writer *w = cols_open(path);
+    if (!w) return -1;
+    for (int i = 0; i < sim->cars.count; i++) {
+        car_slot *slot = arena_at(&sim->cars, i);
+        const trace_car *tr = &slot->trace;
+        if (tr->exit < 0) continue;
+        // the stop actually made: a platoon follower may have skipped it
+        int turn = get_turn_type(sim, tr->orig, tr->target);
+        int64_t unhindered = tr->stop - tr->arrive +
+                             xt_draw(&sim->xt, tr->cid, get_crossing_time(sim, turn));
+        cols_add(w, tr, tr->exit - tr->arrive - unhindered);
+    }
+    return cols_close(w);
+}
+
+
+// Sums the profiles of the sampled cars that exited
+
+int tc_write_profile(tc_sim *sim, const char *path) {
+    prof_car *total = calloc(1, sizeof(prof_car));
+    if (!total) return -1;
+    for (int i = 0; i < sim->cars.count; i++) {
+        car_slot *slot = arena_at(&sim->cars, i);
+        if (slot->prof && slot->trace.exit >= 0)
+            prof_merge(total, slot->prof);
+    }
+
+    char quad[GEOM_MAX_CELLS][32];
+    const char *stack[PF_COUNT];
+    for (int f = 0; f < PF_QUAD; f++)
+        stack[f] = pf_stack[f];
+    for (int c = 0; c < GEOM_MAX_CELLS; c++) {
+        snprintf(quad[c], sizeof(quad[c]), "%s;Q%d", pf_stack[PF_CELLS], c);
+        stack[PF_QUAD + c] = quad[c];
+    }
+
+    int rc = prof_write(path, total, stack, PF_COUNT);
+    free(total);
+    return rc;
+}
+
+
+// Cars arrived on a lane and not yet crossing. A car may arrive and
+// enter on different CPUs, so one shard can go negative; the sum is
+// exact.
+
+static int lane_depth(tc_sim *sim, int lane) {
+    int n = 0;
+    for (int i = 0; i < STAT_SHARDS; i++)
+        n += atomic_load_explicit(&sim->shards[i].depth[lane], memory_order_relaxed);
+    return n;
+}
+
+
+// Exporter tick: sample the admission counter once a second
+
+static void metrics_tick(void *user) {
+    tc_sim *sim = user;
+    sim->rate_ring[sim->rate_pos] = count_total(sim, CT_ADMITTED);
+    sim->rate_pos = (sim->rate_pos + 1) % RATE_WINDOW;
+    if (sim->rate_n < RATE_WINDOW) sim->rate_n++;
+
+    int64_t now = get_sim_usec(sim);
+    for (int l = 0; l < GEOM_LANE_SLOTS; l++)
+        oema_sample(&sim->queue_avg[l], now, lane_depth(sim, l));
+}
+
+
+// All latency shards merged; safe while cars are still exiting
+
+static void merged_latency(tc_sim *sim, ohist *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < STAT_SHARDS; i++)
+        ohist_merge_shared(out, &sim->shards[i].lat);
+}
+
+
+double tc_latency_quantile(tc_sim *sim, double q) {
+    ohist h;
+    merged_latency(sim, &h);
+    return ohist_quantile(&h, q) / 1e6;
+}
+
+
+static void metrics_render(FILE *out, void *user) {
+    tc_sim *sim = user;
+    const geom *g = &sim->geom;
+
+    fprintf(out, "# HELP tc_lane_queue_depth Cars arrived on a lane and not yet crossing.\n"
+                 "# TYPE tc_lane_queue_depth gauge\n");
+    for (int d = 0; d < g->nlegs; d++)
+        for (int l = 0; l < g->nlanes[d]; l++)
+            fprintf(out, "tc_lane_queue_depth{leg=\"%c\",lane=\"%d\"} %d\n",
+                    g->leg_sym[d], l, lane_depth(sim, d * GEOM_MAX_LANES + l));
+
+    fprintf(out, "# HELP tc_lane_queue_avg Lane queue depth, %.0f s moving average.\n"
+                 "# TYPE tc_lane_queue_avg gauge\n", QUEUE_TAU / 1e6);
+    for (int d = 0; d < g->nlegs; d++)
+        for (int l = 0; l < g->nlanes[d]; l++)
+            fprintf(out, "tc_lane_queue_avg{leg=\"%c\",lane=\"%d\"} %.3f\n",
+                    g->leg_sym[d], l, sim->queue_avg[d * GEOM_MAX_LANES + l].value);
+
+    fprintf(out, "# HELP tc_quadrant_cars Cars inside each quadrant.\n"
+                 "# TYPE tc_quadrant_cars gauge\n");
+    for (int q = 0; q < g->ncells; q++)
+        fprintf(out, "tc_quadrant_cars{quadrant=\"%d\"} %d\n", q,
+                QW_COUNT(atomic_load_explicit(&sim->quads[q], memory_order_relaxed)));
+
+    long admitted = count_total(sim, CT_ADMITTED);
+    fprintf(out, "# HELP tc_cars_admitted_total Cars that entered the intersection.\n"
+                 "# TYPE tc_cars_admitted_total counter\n"
+                 "tc_cars_admitted_total %ld\n", admitted);
+    fprintf(out, "# HELP tc_cars_exited_total Cars that left the intersection.\n"
+                 "# TYPE tc_cars_exited_total counter\n"
+                 "tc_cars_exited_total %ld\n", count_total(sim, CT_EXITED));
+
+    // oldest sample in the ring is rate_n seconds old
+    double rate = 0;
+    if (sim->rate_n > 0) {
+        int oldest = (sim->rate_pos - sim->rate_n + RATE_WINDOW) % RATE_WINDOW;
+        rate = (double)(admitted - sim->rate_ring[oldest]) / sim->rate_n;
+    }
+    fprintf(out, "# HELP tc_admit_rate Cars admitted per second over the last %d s.\n"
+                 "# TYPE tc_admit_rate gauge\n"
+                 "tc_admit_rate %.3f\n", RATE_WINDOW, rate);
+
+    metrics_hist wait = {0};
+    for (int i = 0; i < STAT_SHARDS; i++)
+        metrics_hist_merge(&wait, &sim->shards[i].wait);
+    metrics_hist_write(out, "tc_wait_seconds", "Stop complete to entry wait.", &wait);
+
+    ohist lat;
+    merged_latency(sim, &lat);
+    fprintf(out, "# HELP tc_latency_seconds Arrival to exit.\n"
+                 "# TYPE tc_latency_seconds summary\n");
+    static const double qs[] = { 0.5, 0.9, 0.95, 0.99 };
+    for (int i = 0; i < 4; i++)
+        fprintf(out, "tc_latency_seconds{quantile=\"%g\"} %.6f\n",
+                qs[i], ohist_quantile(&lat, qs[i]) / 1e6);
+    fprintf(out, "tc_latency_seconds_sum %.6f\ntc_latency_seconds_count %llu\n",
+            lat.sum / 1e6, (unsigned long long)lat.n);
+
+    fprintf(out, "# HELP tc_lock_contended_total Acquisitions that had to block.\n"
+                 "# TYPE tc_lock_contended_total counter\n"
+                 "tc_lock_contended_total{lock=\"lane\"} %ld\n"
+                 "tc_lock_contended_total{lock=\"cells\"} %ld\n",
+            count_total(sim, CT_LANE_WAITS), count_total(sim, CT_CELL_WAITS));
+    fprintf(out, "# HELP tc_priority_wakeups_total Wake-ups of cars waiting for earlier-stopped cars.\n"
+                 "# TYPE tc_priority_wakeups_total counter\n"
+                 "tc_priority_wakeups_total %ld\n"
+                 "# HELP tc_priority_spurious_wakeups_total Of those, wake-ups with an earlier car still waiting.\n"
+                 "# TYPE tc_priority_spurious_wakeups_total counter\n"
+                 "tc_priority_spurious_wakeups_total %ld\n",
+            count_total(sim, CT_WAKEUPS), count_total(sim, CT_SPURIOUS));
+}
+
+
+void tc_get_counters(tc_sim *sim, tc_counters *out) {
+    out->admitted   = count_total(sim, CT_ADMITTED);
+    out->exited     = count_total(sim, CT_EXITED);
+    out->lane_waits = count_total(sim, CT_LANE_WAITS);
+    out->cell_waits = count_total(sim, CT_CELL_WAITS);
+    out->wakeups    = count_total(sim, CT_WAKEUPS);
+    out->spurious   = count_total(sim, CT_SPURIOUS);
 }
 
 
+int tc_serve_metrics(tc_sim *sim, const char *path) {
+    if (sim->metrics) return -1;
+    sim->metrics = metrics_serve(path, metrics_render, metrics_tick, sim);
+    return sim->metrics ? 0 : -1;
+}
+
+
+// Start one thread per car and wait for all of them
+
+int tc_run(tc_sim *sim) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CAR_STACK);
+
+    gettimeofday(&sim->start_time, NULL);
+
+    int started = 0;
+    for (int i = 0; i < sim->cars.count; i++) {
+        car_slot *slot = arena_at(&sim->cars, i);
+        if (pthread_create(&slot->thread, &attr, car_thread, slot) != 0)
+            break;
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(arena_at(&sim->cars, i)->thread, NULL);
+
+    return started == sim->cars.count ? 0 : -1;
+}
+
+
+#ifndef TC_NO_MAIN
+
+#include <getopt.h>
+
+
 // Hardcoded test cars from P3
 
-void init_cars() {
-    cars[0] = (car_info){1, 1.1, {'^','^'}, 0,0,0,0,0};
-    cars[1] = (car_info){2, 2.2, {'^','^'}, 0,0,0,0,0};
-    cars[2] = (car_info){3, 3.3, {'^','<'}, 0,0,0,0,0};
-    cars[3] = (car_info){4, 4.4, {'v','v'}, 0,0,0,0,0};
-    cars[4] = (car_info){5, 5.5, {'v','>'}, 0,0,0,0,0};
-    cars[5] = (car_info){6, 6.6, {'^','^'}, 0,0,0,0,0};
-    cars[6] = (car_info){7, 7.7, {'>','^'}, 0,0,0,0,0};
-    cars[7] = (car_info){8, 8.8, {'<','^'}, 0,0,0,0,0};
+static const car_info test_cars[] = {
+    {1, 1.1, {'^','^'}, 0,0,0,0,0,0},
+    {2, 2.2, {'^','^'}, 0,0,0,0,0,0},
+    {3, 3.3, {'^','<'}, 0,0,0,0,0,0},
+    {4, 4.4, {'v','v'}, 0,0,0,0,0,0},
+    {5, 5.5, {'v','>'}, 0,0,0,0,0,0},
+    {6, 6.6, {'^','^'}, 0,0,0,0,0,0},
+    {7, 7.7, {'>','^'}, 0,0,0,0,0,0},
+    {8, 8.8, {'<','^'}, 0,0,0,0,0,0},
+};
+
+
+// Reads "key = value" lines; '#' starts a comment
+
+static int load_config(tc_config *cfg, const char *path, char *cars_path,
+                       char *geom_path, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = 0;
+
+        char key[64], value[192];
+        if (sscanf(line, " %63[^= \t] = %191s", key, value) != 2)
+            continue;
+        if (!strcmp(key, "cars")) {
+            snprintf(cars_path, len, "%s", value);
+        } else if (!strcmp(key, "geometry")) {
+            snprintf(geom_path, len, "%s", value);
+        } else if (tc_config_set(cfg, key, value) != 0) {
+            fprintf(stderr, "%s:%d: bad setting '%s'\n", path, lineno, key);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+
+// Reads one car per line: cid arrival orig target
+
+static int load_cars(tc_sim *sim, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[strspn(line, " \t")] == '#') continue;
+
+        car_info car = {0};
+        char orig, target;
+        int k = sscanf(line, "%d %lf %c %c", &car.cid, &car.arrival_time, &orig, &target);
+        if (k <= 0) continue;
+        car.dir.dir_original = orig;
+        car.dir.dir_target = target;
+        if (k != 4 || tc_add_car(sim, &car) != 0) {
+            fprintf(stderr, "%s:%d: bad car\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-c config] [-f cars] [-g geometry] [-s stop] [-l left]\n"
+        "          [-S straight] [-r right] [-a hold|reserve] [-m margin]\n"
+        "          [-p headway] [-b max-batch] [-A max-age] [-w] [-M socket]\n"
+        "          [-t trace.json] [-R results] [-P profile] [-n every]\n"
+        "          [-x spread] [-L]\n"
+        "  times in seconds; cars file lines are: cid arrival orig target\n"
+        "  -w prints the longest wait per direction, latency quantiles and\n"
+        "     event counts at the end\n"
+        "  -M serves Prometheus metrics on a Unix socket while running\n"
+        "  -t writes every car's timeline as Chrome trace JSON at the end\n"
+        "  -R writes one row per car to a column-chunk file at the end\n"
+        "  -P writes where cars spent their time as folded stacks (flame\n"
+        "     graph input) at the end; -n N profiles only 1 car in N\n"
+        "  -x draws each car's actual crossing time around the nominal one\n"
+        "     with this relative spread; -L plans with crossing times\n"
+        "     learned per movement\n"
+        "  config file lines are: key = value (stop_time, delta_l, delta_s,\n"
+        "  delta_r, admit, reserve_margin, platoon_headway, share_max_batch,\n"
+        "  share_max_age, cross_spread, cross_learn, profile_every, cars,\n"
+        "  geometry);\n"
+        "  command line options override the config file\n",
+        prog);
 }
 
 // Main entry
 
-int main() {
-    pthread_t threads[NUM_CARS];
+int main(int argc, char **argv) {
+    tc_config cfg;
+    tc_default_config(&cfg);
+    char cars_path[192] = "";
+    char geom_path[192] = "";
+    geom g;
+    int show_wait = 0;
+    const char *metrics_path = NULL;
+    const char *trace_path = NULL;
+    const char *results_path = NULL;
+    const char *profile_path = NULL;
+
+    // config files in a first pass so command line settings win; the
+    // same getopt() parse as below catches -c FILE, -cFILE and -wcFILE
+    const char *opts = "c:f:g:s:l:S:r:a:m:p:b:A:wM:t:R:P:n:x:Lh";
+    int c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, opts)) != -1)
+        if (c == 'c' &&
+            load_config(&cfg, optarg, cars_path, geom_path, sizeof(cars_path)) != 0)
+            return 1;
+    opterr = 1;
+    optind = 1;
+
+    while ((c = getopt(argc, argv, opts)) != -1) {
+        int bad = 0;
+        switch (c) {
+            case 'c': break;
+            case 'f': snprintf(cars_path, sizeof(cars_path), "%s", optarg); break;
+            case 'g': snprintf(geom_path, sizeof(geom_path), "%s", optarg); break;
+            case 's': bad = tc_config_set(&cfg, "stop_time", optarg); break;
+            case 'l': bad = tc_config_set(&cfg, "delta_l", optarg);   break;
+            case 'S': bad = tc_config_set(&cfg, "delta_s", optarg);   break;
+            case 'r': bad = tc_config_set(&cfg, "delta_r", optarg);   break;
+            case 'a': bad = tc_config_set(&cfg, "admit", optarg);     break;
+            case 'm': bad = tc_config_set(&cfg, "reserve_margin", optarg); break;
+            case 'p': bad = tc_config_set(&cfg, "platoon_headway", optarg); break;
+            case 'b': bad = tc_config_set(&cfg, "share_max_batch", optarg); break;
+            case 'A': bad = tc_config_set(&cfg, "share_max_age", optarg);   break;
+            case 'w': show_wait = 1; break;
+            case 'M': metrics_path = optarg; break;
+            case 't': trace_path = optarg; break;
+            case 'R': results_path = optarg; break;
+            case 'P': profile_path = optarg; break;
+            case 'n': bad = tc_config_set(&cfg, "profile_every", optarg); break;
+            case 'x': bad = tc_config_set(&cfg, "cross_spread", optarg);  break;
+            case 'L': cfg.cross_learn = 1; break;
+            default:  usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+        if (bad) {
+            fprintf(stderr, "bad value: %s\n", optarg);
+            return 1;
+        }
+    }
+
+    if (geom_path[0]) {
+        if (geom_load(&g, geom_path) != 0) return 1;
+    } else {
+        geom_default(&g);
+    }
+    cfg.geom = &g;
+    if (profile_path && cfg.profile_every == 0)
+        cfg.profile_every = 1;
+
+    tc_sim *sim = tc_create(&cfg);
+    if (!sim) return 1;
+    if (metrics_path && tc_serve_metrics(sim, metrics_path) != 0) {
+        tc_destroy(sim);
+        return 1;
+    }
 
-    init_cars();
-    init_system();
-    gettimeofday(&start_time, NULL);
+    if (cars_path[0]) {
+        if (load_cars(sim, cars_path) != 0) {
+            tc_destroy(sim);
+            return 1;
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(test_cars) / sizeof(test_cars[0]); i++)
+            tc_add_car(sim, &test_cars[i]);
+    }
 
     printf("Traffic Control Simulation Started\n");
     printf("===================================\n");
 
-    for (int i = 0; i < NUM_CARS; i++)
-        pthread_create(&threads[i], NULL, car_thread, &cars[i]);
-
-    for (int i = 0; i < NUM_CARS; i++)
-        pthread_join(threads[i], NULL);
+    int rc = tc_run(sim);
 
     printf("===================================\n");
     printf("Simulation Complete\n");
 
-    return 0;
+    if (show_wait) {
+        for (int d = 0; d < g.nlegs; d++)
+            printf("max wait %c: %.1f\n", g.leg_sym[d], tc_max_wait(sim, d));
+        printf("latency p50 %.2f p95 %.2f p99 %.2f\n", tc_latency_quantile(sim, 0.5),
+               tc_latency_quantile(sim, 0.95), tc_latency_quantile(sim, 0.99));
+        tc_counters n;
+        tc_get_counters(sim, &n);
+        printf("admitted %ld, lane waits %ld, cell waits %ld, wakeups %ld (%ld spurious)\n",
+               n.admitted, n.lane_waits, n.cell_waits, n.wakeups, n.spurious);
+    }
+    if (trace_path && tc_write_trace(sim, trace_path) != 0)
+        rc = -1;
+    if (results_path && tc_write_results(sim, results_path) != 0)
+        rc = -1;
+    if (profile_path && tc_write_profile(sim, profile_path) != 0)
+        rc = -1;
+
+    tc_destroy(sim);
+    return rc ? 1 : 0;
 }
+
+#endif
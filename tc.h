@@ -0,0 +1,149 @@
+#ifndef TC_H
+#define TC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "geom.h"
+#include "resv.h"
+#include "xtime.h"
+
+
+// Direction pair for each car
+
+typedef struct {
+    char dir_original;
+    char dir_target;
+} directions;
+
+
+// Per-car state tracking
+
+typedef struct {
+    int cid;                // car ID
+    double arrival_time;    // scheduled arrival
+    directions dir;         // original + target directions
+    double stop_complete_time;
+    int at_front;           // is at front of lane?
+    int waiting;            // waiting at stop sign?
+    int crossing;           // currently in intersection?
+    int done;               // finished crossing?
+    int following;          // platooning behind the previous car?
+} car_info;
+
+
+// Timing configuration (microseconds) and geometry
+
+typedef struct {
+    int stop_time;
+    int delta_l;
+    int delta_s;
+    int delta_r;
+    const geom *geom;    // copied at create; NULL = default 4-way
+    int admit;           // ADMIT_HOLD or ADMIT_RESERVE
+    int reserve_margin;  // per-cell slack in reservation mode
+    int platoon_headway; // hold mode: follow same-movement leader, 0 = off
+    int share_max_batch; // cars one leg may add to a held cell, 0 = no limit
+    int share_max_age;   // how long one leg may keep adding, 0 = no limit
+    double cross_spread; // relative spread of actual crossing times, see xtime.h
+    int cross_learn;     // plan with crossing times learned per movement
+    int profile_every;   // profile 1 in this many cars, 0 = off; see prof.h
+} tc_config;
+
+void tc_default_config(tc_config *cfg);
+
+// Sets stop_time, delta_l, delta_s, delta_r, reserve_margin,
+// platoon_headway or share_max_age from a value in seconds,
+// share_max_batch or profile_every from a count, cross_spread from a
+// ratio, cross_learn from 0 / 1, or admit from "hold" / "reserve"
+int  tc_config_set(tc_config *cfg, const char *key, const char *value);
+
+
+// Event stream, one entry per car phase change
+
+enum {
+    TC_ARRIVING,
+    TC_CROSSING,
+    TC_EXITING
+};
+
+typedef struct {
+    int64_t time;    // microseconds since tc_run started
+    int cid;
+    int type;        // TC_*
+    char orig;
+    char target;
+} tc_event;
+
+typedef void (*tc_event_fn)(const tc_event *ev, void *user);
+
+
+// Simulator context: one per intersection, no shared state between them
+
+typedef struct tc_sim tc_sim;
+
+// cfg may be NULL for defaults; returns NULL on allocation failure
+tc_sim *tc_create(const tc_config *cfg);
+void    tc_destroy(tc_sim *sim);
+
+// Copies a car into the simulator's arena; call before tc_run. Fails if
+// the geometry has no such movement.
+int     tc_add_car(tc_sim *sim, const car_info *car);
+int     tc_num_cars(const tc_sim *sim);
+
+// Event output stream (default stdout, NULL for none)
+void    tc_set_output(tc_sim *sim, FILE *out);
+
+// Deliver events to fn as they happen (NULL to disable); call before
+// tc_run. fn runs on the car threads, one event at a time and in the
+// order of the text output, so it needs no locking of its own but
+// stalls every car while it runs. It must not call back into the same
+// tc_sim.
+void    tc_set_callback(tc_sim *sim, tc_event_fn fn, void *user);
+
+// Runs one thread per car in real time; returns when all cars exited.
+// Scenarios are bounded by the threads the system will start (64 KiB
+// stacks each), so tc suits up to some thousands of cars; use vsim for
+// larger ones.
+int     tc_run(tc_sim *sim);
+
+// Serves live Prometheus metrics on a Unix socket until tc_destroy
+// (queue depth per lane, quadrant occupancy, admissions, wait histogram,
+// lock contention); see metrics.h
+int     tc_serve_metrics(tc_sim *sim, const char *path);
+
+// Writes every car's phases and quadrant holds as Chrome trace JSON
+// (see trace.h); call after tc_run
+int     tc_write_trace(tc_sim *sim, const char *path);
+
+// Writes one row per car (phase times and delay) as a column-chunk file
+// (see cols.h); call after tc_run
+int     tc_write_results(tc_sim *sim, const char *path);
+
+// Writes where the profiled cars' time went, phase by phase and per
+// quadrant taken, as folded stacks for a flame graph (see prof.h and
+// PF_* in tc.c); call after tc_run with profile_every set
+int     tc_write_profile(tc_sim *sim, const char *path);
+
+// Longest stop-complete -> entry wait in seconds for a leg, or over all
+// legs when leg < 0
+double  tc_max_wait(tc_sim *sim, int leg);
+
+// Hot-path event counts so far, summed over per-CPU shards; always on
+// and may be read while tc_run is going
+
+typedef struct {
+    long admitted;       // cars that entered the intersection
+    long exited;
+    long lane_waits;     // cars whose lane turn was not yet due after the stop
+    long cell_waits;     // path acquisitions that had to queue
+    long wakeups;        // wake-ups while waiting for earlier-stopped cars
+    long spurious;       // of those, with an earlier car still waiting
+} tc_counters;
+
+void    tc_get_counters(tc_sim *sim, tc_counters *out);
+
+// Arrival -> exit latency quantile (0..1) in seconds over the cars that
+// have exited so far, within 1.6%; may be called while tc_run is going
+double  tc_latency_quantile(tc_sim *sim, double q);
+
+#endif
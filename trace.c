@@ -0,0 +1,73 @@
+#include "trace.h"
+
+
+#define PID_CARS  1
+#define PID_CELLS 2
+
+
+static void meta(FILE *f, const char *what, int pid, int tid, const char *name) {
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+               "\"args\":{\"name\":\"%s\"}},\n", what, pid, tid, name);
+}
+
+
+FILE *trace_begin(const char *path, const geom *g) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    meta(f, "process_name", PID_CARS, 0, "cars");
+    meta(f, "process_name", PID_CELLS, 0, "quadrants");
+    for (int q = 0; q < g->ncells; q++) {
+        char name[16];
+        snprintf(name, sizeof(name), "Q%d", q);
+        meta(f, "thread_name", PID_CELLS, q, name);
+    }
+    return f;
+}
+
+
+// One complete event; empty phases are skipped
+
+static void phase(FILE *f, const trace_car *car, const char *name,
+                  int64_t from, int64_t to) {
+    if (from < 0 || to <= from) return;
+    fprintf(f, "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+               "\"ts\":%lld,\"dur\":%lld},\n",
+            name, PID_CARS, car->cid, (long long)from, (long long)(to - from));
+}
+
+
+void trace_add(FILE *f, const trace_car *car) {
+    char name[32];
+    snprintf(name, sizeof(name), "car %d %c%c", car->cid, car->orig, car->target);
+    meta(f, "thread_name", PID_CARS, car->cid, name);
+
+    phase(f, car, "stop",  car->arrive, car->stop);
+    phase(f, car, "queue", car->stop,   car->front);
+    phase(f, car, "admit", car->front,  car->grant);
+    phase(f, car, "hold",  car->grant,  car->cross);
+    phase(f, car, "cross", car->cross,  car->exit);
+
+    if (car->grant < 0 || car->exit < 0) return;
+    for (geom_mask m = car->cells; m; m &= m - 1) {
+        int q = __builtin_ctzll(m);
+        for (int e = 0; e < 2; e++)
+            fprintf(f, "{\"ph\":\"%c\",\"cat\":\"quadrant\",\"name\":\"Q%d\","
+                       "\"id\":%d,\"pid\":%d,\"tid\":%d,\"ts\":%lld,"
+                       "\"args\":{\"car\":%d}},\n",
+                    e ? 'e' : 'b', q, car->cid * GEOM_MAX_CELLS + q,
+                    PID_CELLS, q, (long long)(e ? car->exit : car->grant), car->cid);
+    }
+}
+
+
+int trace_end(FILE *f) {
+    // a metadata record closes the list so every event above keeps its comma
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"trace_end\",\"pid\":%d,\"tid\":0,"
+               "\"args\":{}}\n]}\n", PID_CARS);
+    int err = ferror(f);
+    return fclose(f) != 0 || err ? -1 : 0;
+}
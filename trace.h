@@ -0,0 +1,38 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "geom.h"
+
+
+// Car timelines as Chrome trace-event JSON
+//
+// Each car becomes one track (pid 1, tid = car ID) with its phases as
+// complete events: stop, queue (stopped, behind another car), admit
+// (front of lane, waiting for cells or an earlier car), hold (granted,
+// waiting for its slot or headway) and cross. Each quadrant a car held
+// is an async span from grant to exit on the quadrant's own track
+// (pid 2), so sharing shows up as overlapping spans. Open the file in
+// chrome://tracing or ui.perfetto.dev. Times are microseconds.
+
+typedef struct {
+    int cid;
+    char orig;
+    char target;
+    int64_t arrive;
+    int64_t stop;        // stop complete
+    int64_t front;       // reached the front of its lane
+    int64_t grant;       // cells or reservation granted
+    int64_t cross;
+    int64_t exit;
+    geom_mask cells;     // quadrants held from grant to exit, 0 = none
+} trace_car;
+
+// Returns NULL (after printing why) if path cannot be opened
+FILE *trace_begin(const char *path, const geom *g);
+void  trace_add(FILE *f, const trace_car *car);
+// Returns 0 on success, -1 on a write error
+int   trace_end(FILE *f);
+
+#endif
@@ -0,0 +1,622 @@
+// Offline checker for intersection event logs
+//
+// Build: gcc -O2 -o validate validate.c geom.c pool.c
+//
+// Reads the event log of one run, either tc's text output ("Time T: Car N
+// (o t) arriving|crossing|exiting", other lines are ignored) or a binary
+// log from sweep --events, and checks in a single pass that
+//
+//   conflict   no two cars with different sharing keys are inside the
+//              same cell at once (hold mode)
+//   lane order cars leave each lane in the order they arrived in it
+//   priority   no car enters while a car from another leg has been at the
+//              front of its lane, stopped earlier and is still waiting,
+//              the earlier_car_waiting() rule (hold mode)
+//   sequence   every car arrives, crosses and exits exactly once, in order
+//
+// Only cars still in the intersection are kept, so memory is bounded by
+// the busiest moment, not the length of the log. Events that share a
+// timestamp are applied exits first, then arrivals, then entries, since a
+// car releases its cells before the next one takes them but the printed
+// order of the two is a race.
+//
+// Stop-complete and front-of-lane times are reconstructed from the log
+// (arrival + stop time, and when the car ahead crossed), so priority and
+// lane order are only flagged when the earlier car's lead exceeds the
+// slack, by default the 0.1 s resolution of text logs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include "geom.h"
+#include "pool.h"
+#include "evlog.h"
+
+
+// Default time constants (microseconds), as in tc.c
+
+#define STOP_TIME 2000000
+#define TEXT_SLACK 100000
+
+// Violations printed in full before only counting
+#define REPORT_MAX 20
+
+
+enum {
+    CK_CONFLICT,
+    CK_LANE_ORDER,
+    CK_PRIORITY,
+    CK_SEQUENCE,
+    CK_COUNT
+};
+
+static const char *check_name[CK_COUNT] = {
+    "conflict", "lane order", "priority", "sequence"
+};
+
+
+// Car between arrival and exit
+
+typedef struct flight flight;
+
+struct flight {
+    flight *next;        // next car in the same lane
+    int cid;
+    char orig;
+    char target;
+    int lane;
+    int key;
+    int tgt;
+    geom_mask mask;
+    int64_t arrive;
+    int64_t stop;        // stop complete
+    int64_t front;       // stopped at the front of its lane, -1 = not yet
+    int64_t cross;       // -1 = not yet
+    int follower;        // joined a platoon on arrival, so did not stop
+    int follows;         // leader still inside when it reached the front
+};
+
+
+typedef struct {
+    geom g;
+    int64_t stop_time;
+    int64_t slack;
+    int hold;            // hold-mode checks (conflict, priority)
+    int platoon;
+    int backfill;        // priority may be passed on purpose, not checked
+
+    pool cars;
+    flight **index;      // cid -> car, open addressing
+    uint32_t index_mask;
+    int inflight;
+    int max_inflight;
+
+    flight *lane_head[GEOM_LANE_SLOTS];
+    flight *lane_tail[GEOM_LANE_SLOTS];
+    flight *leader[GEOM_LANE_SLOTS];      // last car to enter from the lane, if still inside
+    int cell_count[GEOM_MAX_CELLS];
+    int cell_key[GEOM_MAX_CELLS];
+
+    evlog_rec *batch;    // events sharing the current timestamp
+    int nbatch;
+    int batchcap;
+
+    uint64_t events;
+    uint64_t ncars;
+    uint64_t skipped;    // unparsed text lines
+    uint64_t violations[CK_COUNT];
+    uint64_t reported;
+} checker;
+
+
+static void violation(checker *ck, int kind, int64_t t, const char *fmt,
+                      int cid, char orig, char target, int other) {
+    ck->violations[kind]++;
+    if (ck->reported++ >= REPORT_MAX) return;
+    printf("%.6f: %s: car %d (%c %c) ", t / 1e6, check_name[kind], cid, orig, target);
+    printf(fmt, other);
+    putchar('\n');
+}
+
+
+// Hash table of cars in flight, linear probing with backward-shift delete
+
+static uint32_t slot_of(const checker *ck, int cid) {
+    return ((uint32_t)cid * 0x9e3779b1u) & ck->index_mask;
+}
+
+static flight *find_car(const checker *ck, int cid) {
+    for (uint32_t i = slot_of(ck, cid);; i = (i + 1) & ck->index_mask) {
+        flight *f = ck->index[i];
+        if (!f || f->cid == cid) return f;
+    }
+}
+
+static int insert_car(checker *ck, flight *car);
+
+static int grow_index(checker *ck) {
+    flight **old = ck->index;
+    uint32_t n = ck->index_mask + 1;
+    ck->index = calloc(2 * (size_t)n, sizeof(flight*));
+    if (!ck->index) {
+        ck->index = old;
+        return -1;
+    }
+    ck->index_mask = 2 * n - 1;
+    for (uint32_t i = 0; i < n; i++)
+        if (old[i]) insert_car(ck, old[i]);
+    free(old);
+    return 0;
+}
+
+static int insert_car(checker *ck, flight *car) {
+    if (2 * (uint32_t)(ck->inflight + 1) > ck->index_mask && grow_index(ck) != 0)
+        return -1;
+    uint32_t i = slot_of(ck, car->cid);
+    while (ck->index[i])
+        i = (i + 1) & ck->index_mask;
+    ck->index[i] = car;
+    return 0;
+}
+
+static void remove_car(checker *ck, flight *car) {
+    uint32_t i = slot_of(ck, car->cid);
+    while (ck->index[i] != car)
+        i = (i + 1) & ck->index_mask;
+    for (uint32_t j = (i + 1) & ck->index_mask; ck->index[j]; j = (j + 1) & ck->index_mask) {
+        uint32_t home = slot_of(ck, ck->index[j]->cid);
+        // move j back to i unless its home lies cyclically in (i, j]
+        if (((j - home) & ck->index_mask) >= ((j - i) & ck->index_mask)) {
+            ck->index[i] = ck->index[j];
+            i = j;
+        }
+    }
+    ck->index[i] = NULL;
+}
+
+
+// Front of lane once both stopped and nobody is ahead
+
+static void became_head(flight *car, int64_t t) {
+    car->front = car->stop > t ? car->stop : t;
+}
+
+
+// Platoon follower: same movement as the car that last entered from its
+// lane, which is still inside when the follower reaches the front. A
+// follower may wait out its headway, after its leader has left, but
+// holds its cells and skips the earlier-car rule, and does not hold up
+// other legs while it waits.
+
+static int following(const checker *ck, const flight *car) {
+    const flight *lead = ck->leader[car->lane];
+    return ck->platoon && lead && lead->tgt == car->tgt;
+}
+
+
+static void on_arrive(checker *ck, const evlog_rec *ev) {
+    if (find_car(ck, ev->cid)) {
+        violation(ck, CK_SEQUENCE, ev->time, "arrived twice", ev->cid, ev->orig, ev->target, 0);
+        return;
+    }
+    int orig = geom_leg(&ck->g, ev->orig);
+    int tgt = geom_leg(&ck->g, ev->target);
+    if (orig < 0 || tgt < 0 || ck->g.move_turn[orig][tgt] == TURN_NONE) {
+        violation(ck, CK_SEQUENCE, ev->time, "movement not in the geometry",
+                  ev->cid, ev->orig, ev->target, 0);
+        return;
+    }
+
+    flight *car = pool_get(&ck->cars);
+    if (!car) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+    car->next = NULL;
+    car->cid = ev->cid;
+    car->orig = ev->orig;
+    car->target = ev->target;
+    car->lane = geom_lane(&ck->g, orig, tgt);
+    car->key = geom_key(&ck->g, orig, tgt);
+    car->tgt = tgt;
+    car->mask = ck->g.move_mask[orig][tgt];
+    car->arrive = ev->time;
+    car->front = -1;
+    car->cross = -1;
+
+    // same test as tc's skip_stop: empty lane, same-movement leader inside
+    car->follower = !ck->lane_head[car->lane] && following(ck, car);
+    car->stop = car->follower ? ev->time : ev->time + ck->stop_time;
+    car->follows = car->follower;
+    if (insert_car(ck, car) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    if (ck->lane_tail[car->lane]) {
+        ck->lane_tail[car->lane]->next = car;
+    } else {
+        ck->lane_head[car->lane] = car;
+        became_head(car, ev->time);
+    }
+    ck->lane_tail[car->lane] = car;
+
+    ck->ncars++;
+    if (++ck->inflight > ck->max_inflight)
+        ck->max_inflight = ck->inflight;
+}
+
+
+// Another leg's lane head that stopped and reached the front well before
+// this car and is still waiting, or NULL
+
+static flight *passed_over(const checker *ck, const flight *car) {
+    for (int lane = 0; lane < GEOM_LANE_SLOTS; lane++) {
+        if (lane / GEOM_MAX_LANES == car->lane / GEOM_MAX_LANES) continue;
+        flight *h = ck->lane_head[lane];
+        if (h && h->cross < 0 && !h->follows &&
+            h->stop + ck->slack < car->stop &&
+            h->front + ck->slack < car->front)
+            return h;
+    }
+    return NULL;
+}
+
+
+// Takes a car out of its lane queue; it should be the head. Cars that
+// arrive within the slack of each other may queue in either order.
+
+static void leave_lane(checker *ck, flight *car, int64_t t) {
+    flight **p = &ck->lane_head[car->lane];
+    flight *prev = NULL;
+    if (*p != car) {
+        if ((*p)->arrive + ck->slack < car->arrive)
+            violation(ck, CK_LANE_ORDER, t, "entered ahead of car %d",
+                      car->cid, car->orig, car->target, (*p)->cid);
+        while (*p != car) {
+            prev = *p;
+            p = &(*p)->next;
+        }
+    }
+    *p = car->next;
+    if (ck->lane_tail[car->lane] == car)
+        ck->lane_tail[car->lane] = prev;
+    if (!prev && car->next)
+        became_head(car->next, t);
+    car->next = NULL;
+}
+
+
+static void on_cross(checker *ck, flight *car, int64_t t) {
+    leave_lane(ck, car, t);
+
+    if (ck->hold) {
+        if (!ck->backfill && !car->follows) {
+            flight *h = passed_over(ck, car);
+            if (h)
+                violation(ck, CK_PRIORITY, t, "entered before earlier-stopped car %d",
+                          car->cid, car->orig, car->target, h->cid);
+        }
+        for (geom_mask m = car->mask; m; m &= m - 1) {
+            int q = __builtin_ctzll(m);
+            if (ck->cell_count[q] > 0 && ck->cell_key[q] != car->key)
+                violation(ck, CK_CONFLICT, t, "entered cell %d while another key holds it",
+                          car->cid, car->orig, car->target, q);
+        }
+    }
+    for (geom_mask m = car->mask; m; m &= m - 1) {
+        int q = __builtin_ctzll(m);
+        ck->cell_count[q]++;
+        ck->cell_key[q] = car->key;
+    }
+    ck->leader[car->lane] = car;
+
+    // the next car follows this one if it is still inside when that car
+    // reaches the front; on_depart() takes that back if it is not
+    flight *next = ck->lane_head[car->lane];
+    if (next) next->follows = following(ck, next);
+}
+
+
+static void on_depart(checker *ck, const evlog_rec *ev) {
+    flight *car = find_car(ck, ev->cid);
+    if (!car) {
+        violation(ck, CK_SEQUENCE, ev->time, "exited without arriving",
+                  ev->cid, ev->orig, ev->target, 0);
+        return;
+    }
+    if (car->cross < 0) {
+        violation(ck, CK_SEQUENCE, ev->time, "exited without crossing",
+                  ev->cid, ev->orig, ev->target, 0);
+        leave_lane(ck, car, ev->time);
+    } else {
+        for (geom_mask m = car->mask; m; m &= m - 1)
+            ck->cell_count[__builtin_ctzll(m)]--;
+    }
+    if (ck->leader[car->lane] == car) {
+        ck->leader[car->lane] = NULL;
+        flight *next = ck->lane_head[car->lane];
+        if (next && next->front > ev->time) next->follows = 0;
+    }
+    remove_car(ck, car);
+    pool_put(&ck->cars, car);
+    ck->inflight--;
+}
+
+
+// The batch's exit event of car cid, if any
+
+static evlog_rec *batch_exit(checker *ck, int cid) {
+    for (int i = 0; i < ck->nbatch; i++)
+        if (ck->batch[i].type == EVLOG_EXITING && ck->batch[i].cid == cid)
+            return &ck->batch[i];
+    return NULL;
+}
+
+
+// Applies all events of one timestamp. Exits of cars that crossed
+// earlier go first, freeing their cells, then arrivals, then entries.
+// Entries are stamped first so that a car entering in the same batch does
+// not count as waiting for the priority check. With crossing times under
+// the log's resolution a car may also arrive, cross and exit within one
+// timestamp; its own events are applied in that order, and a car that
+// both enters and leaves is checked against the cells held before the
+// batch only, since it may have been gone before the others entered.
+// Exits left over are errors reported by on_depart().
+
+static void flush_batch(checker *ck) {
+    for (int i = 0; i < ck->nbatch; i++) {
+        evlog_rec *ev = &ck->batch[i];
+        if (ev->type != EVLOG_EXITING) continue;
+        flight *car = find_car(ck, ev->cid);
+        if (car && car->cross >= 0) {
+            on_depart(ck, ev);
+            ev->type = 0xff;
+        }
+    }
+    for (int i = 0; i < ck->nbatch; i++)
+        if (ck->batch[i].type == EVLOG_ARRIVING) on_arrive(ck, &ck->batch[i]);
+
+    for (int i = 0; i < ck->nbatch; i++) {
+        evlog_rec *ev = &ck->batch[i];
+        if (ev->type != EVLOG_CROSSING) continue;
+        flight *car = find_car(ck, ev->cid);
+        if (!car || car->cross >= 0) {
+            violation(ck, CK_SEQUENCE, ev->time,
+                      car ? "crossed twice" : "crossed without arriving",
+                      ev->cid, ev->orig, ev->target, 0);
+            ev->type = 0xff;             // reported, skip below
+            continue;
+        }
+        car->cross = ev->time;
+    }
+    for (int i = 0; i < ck->nbatch; i++) {
+        evlog_rec *ev = &ck->batch[i];
+        evlog_rec *ex = ev->type == EVLOG_CROSSING ? batch_exit(ck, ev->cid) : NULL;
+        if (!ex) continue;
+        on_cross(ck, find_car(ck, ev->cid), ev->time);
+        on_depart(ck, ex);
+        ev->type = ex->type = 0xff;
+    }
+    for (int i = 0; i < ck->nbatch; i++)
+        if (ck->batch[i].type == EVLOG_CROSSING)
+            on_cross(ck, find_car(ck, ck->batch[i].cid), ck->batch[i].time);
+    for (int i = 0; i < ck->nbatch; i++)
+        if (ck->batch[i].type == EVLOG_EXITING) on_depart(ck, &ck->batch[i]);
+    ck->nbatch = 0;
+}
+
+
+static void feed(checker *ck, const evlog_rec *ev) {
+    ck->events++;
+    if (ck->nbatch > 0 && ev->time != ck->batch[0].time) {
+        if (ev->time < ck->batch[0].time) {
+            fprintf(stderr, "event log goes back in time at %.6f\n", ev->time / 1e6);
+            exit(2);
+        }
+        flush_batch(ck);
+    }
+    if (ck->nbatch == ck->batchcap) {
+        ck->batchcap = ck->batchcap ? 2 * ck->batchcap : 64;
+        ck->batch = realloc(ck->batch, ck->batchcap * sizeof(evlog_rec));
+        if (!ck->batch) {
+            fprintf(stderr, "out of memory\n");
+            exit(2);
+        }
+    }
+    ck->batch[ck->nbatch++] = *ev;
+}
+
+
+// Parses "Time 12.3: Car 5 (^ <) crossing"; returns 0 on success
+
+static int parse_line(const char *s, evlog_rec *ev) {
+    if (strncmp(s, "Time ", 5) != 0) return -1;
+    s += 5;
+
+    int64_t sec = 0, frac = 0, scale = 1000000;
+    if (*s < '0' || *s > '9') return -1;
+    while (*s >= '0' && *s <= '9')
+        sec = sec * 10 + (*s++ - '0');
+    if (*s == '.') {
+        s++;
+        while (*s >= '0' && *s <= '9') {
+            scale /= 10;
+            frac += (*s++ - '0') * scale;
+        }
+    }
+    ev->time = sec * 1000000 + frac;
+
+    if (strncmp(s, ": Car ", 6) != 0) return -1;
+    s += 6;
+    int cid = 0;
+    if (*s < '0' || *s > '9') return -1;
+    while (*s >= '0' && *s <= '9')
+        cid = cid * 10 + (*s++ - '0');
+    ev->cid = cid;
+
+    if (s[0] != ' ' || s[1] != '(' || s[3] != ' ' || s[5] != ')' || s[6] != ' ')
+        return -1;
+    ev->orig = s[2];
+    ev->target = s[4];
+    s += 7;
+
+    if (!strncmp(s, "arriving", 8))      ev->type = EVLOG_ARRIVING;
+    else if (!strncmp(s, "crossing", 8)) ev->type = EVLOG_CROSSING;
+    else if (!strncmp(s, "exiting", 7))  ev->type = EVLOG_EXITING;
+    else return -1;
+    return 0;
+}
+
+
+static void text_line(checker *ck, const char *line) {
+    evlog_rec ev;
+    if (parse_line(line, &ev) == 0)
+        feed(ck, &ev);
+    else
+        ck->skipped++;
+}
+
+
+// head holds what was read while looking for the binary magic: a prefix
+// of it plus the first byte that did not match
+
+static void read_text(checker *ck, FILE *in, const char *head, size_t nhead) {
+    char line[256];
+    size_t n = nhead;
+    memcpy(line, head, nhead);
+    if (n && line[n - 1] == '\n') {
+        line[n] = 0;
+        text_line(ck, line);
+        n = 0;
+    }
+    while (fgets(line + n, (int)(sizeof(line) - n), in)) {
+        n = 0;
+        size_t len = strlen(line);
+        if (len && line[len - 1] != '\n' && !feof(in)) {
+            // overlong line: not an event, drop the rest of it
+            int c;
+            while ((c = getc(in)) != EOF && c != '\n')
+                ;
+            ck->skipped++;
+            continue;
+        }
+        text_line(ck, line);
+    }
+    if (n) {
+        line[n] = 0;
+        text_line(ck, line);
+    }
+}
+
+
+static void read_binary(checker *ck, FILE *in) {
+    evlog_rec buf[4096];
+    size_t n;
+    while ((n = fread(buf, sizeof(evlog_rec), 4096, in)) > 0)
+        for (size_t i = 0; i < n; i++)
+            feed(ck, &buf[i]);
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-g geometry] [-s stop] [-e slack] [-a hold|reserve] [-p] [-b] [log]\n"
+        "  -g FILE   intersection geometry the log was made with (default 4-way)\n"
+        "  -s SEC    stop time of the run                        (default 2)\n"
+        "  -e SEC    timing slack for the priority check\n"
+        "            (default 0.1 for text logs, 0 for binary)\n"
+        "  -a MODE   admission model; reserve skips conflict and priority\n"
+        "  -p        run used platooning: followers skip the priority check\n"
+        "  -b        run used backfilling: no priority check\n"
+        "Reads standard input if no log is given. Exit status is 1 if any\n"
+        "check failed.\n", prog);
+}
+
+
+int main(int argc, char **argv) {
+    static checker ck;
+    ck.stop_time = STOP_TIME;
+    ck.slack = -1;
+    ck.hold = 1;
+    geom_default(&ck.g);
+
+    int c;
+    while ((c = getopt(argc, argv, "g:s:e:a:pbh")) != -1) {
+        switch (c) {
+            case 'g': if (geom_load(&ck.g, optarg) != 0) return 2; break;
+            case 's': ck.stop_time = (int64_t)(atof(optarg) * 1e6); break;
+            case 'e': ck.slack = (int64_t)(atof(optarg) * 1e6); break;
+            case 'p': ck.platoon = 1; break;
+            case 'b': ck.backfill = 1; break;
+            case 'a':
+                if (!strcmp(optarg, "hold")) ck.hold = 1;
+                else if (!strcmp(optarg, "reserve")) ck.hold = 0;
+                else { usage(argv[0]); return 2; }
+                break;
+            default:  usage(argv[0]); return c == 'h' ? 0 : 2;
+        }
+    }
+
+    FILE *in = stdin;
+    if (optind < argc && !(in = fopen(argv[optind], "rb"))) {
+        perror(argv[optind]);
+        return 2;
+    }
+
+    pool_init(&ck.cars, sizeof(flight));
+    ck.index_mask = 1023;
+    ck.index = calloc(ck.index_mask + 1, sizeof(flight*));
+    if (!ck.index) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char head[EVLOG_MAGIC_LEN];
+    size_t nhead = 0;
+    int ch;
+    while (nhead < EVLOG_MAGIC_LEN && (ch = getc(in)) != EOF) {
+        head[nhead++] = (char)ch;
+        if (ch != EVLOG_MAGIC[nhead - 1]) break;
+    }
+    int binary = nhead == EVLOG_MAGIC_LEN && !memcmp(head, EVLOG_MAGIC, EVLOG_MAGIC_LEN);
+    if (ck.slack < 0) ck.slack = binary ? 0 : TEXT_SLACK;
+    if (binary)
+        read_binary(&ck, in);
+    else
+        read_text(&ck, in, head, nhead);
+    if (ck.nbatch) flush_batch(&ck);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (in != stdin) fclose(in);
+
+    uint64_t total = 0;
+    if (ck.reported > REPORT_MAX)
+        printf("... %llu more\n", (unsigned long long)(ck.reported - REPORT_MAX));
+    printf("%llu events, %llu cars, at most %d in flight, %.3f s (%.1fM events/s)\n",
+           (unsigned long long)ck.events, (unsigned long long)ck.ncars,
+           ck.max_inflight, secs, secs > 0 ? ck.events / secs / 1e6 : 0);
+    if (ck.skipped)
+        printf("%llu lines were not events\n", (unsigned long long)ck.skipped);
+    if (ck.inflight)
+        printf("%d cars had not exited at the end of the log\n", ck.inflight);
+    for (int k = 0; k < CK_COUNT; k++) {
+        if (!ck.hold && (k == CK_CONFLICT || k == CK_PRIORITY)) continue;
+        if (ck.backfill && k == CK_PRIORITY) continue;
+        printf("  %-11s %llu\n", check_name[k], (unsigned long long)ck.violations[k]);
+        total += ck.violations[k];
+    }
+    printf("%s\n", total ? "FAILED" : "OK");
+
+    free(ck.batch);
+    free(ck.index);
+    pool_destroy(&ck.cars);
+    return total ? 1 : 0;
+}
@@ -0,0 +1,1148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vsim.h"
+#include "pool.h"
+#include "resv.h"
+#include "trace.h"
+#include "batch.h"
+#include "cols.h"
+#include "ostats.h"
+
+
+// Throughput window and queue-length averaging time, microseconds
+
+#define MINUTE    60000000
+#define QUEUE_TAU 60e6
+
+
+// Car life cycle inside the event loop
+
+enum {
+    VC_PENDING,      // not yet arrived
+    VC_STOPPING,     // at stop sign
+    VC_QUEUED,       // stopped, behind another car in lane
+    VC_HEAD,         // front of lane, waiting on earlier cars
+    VC_ACQUIRING,    // front of lane, queued for its cells
+    VC_RESERVED,     // front of lane, waiting for its reserved slot
+    VC_FOLLOWING,    // front of lane, sharing the leader's grant
+    VC_CROSSING,
+    VC_DONE
+};
+
+enum { EV_ARRIVE, EV_STOP, EV_CROSS, EV_EXIT, EV_RETRY };
+
+
+typedef struct vcar vcar;
+
+struct vcar {
+    vcar *next;      // lane queue, then exit batch (pool link when free)
+    int cid;
+    char orig;
+    char target;
+    int dir;         // geometry leg
+    int key;         // sharing key, see geom_key()
+    int tgt;         // target leg
+    int lane;        // lane slot, see geom_lane()
+    geom_mask mask;
+    geom_mask held;  // cells granted, all or none
+    uint64_t wait_seq;  // position in the acquisition queue
+    int64_t nominal;     // configured crossing time of the movement
+    int64_t cross_time;  // actual, see xt_draw()
+    int64_t arrival;
+    int64_t stop_complete;
+    int64_t front;       // became lane head
+    int64_t grant;       // cells or reservation granted
+    int64_t cross_start;
+    int64_t exit_time;
+    int state;
+};
+
+
+typedef struct {
+    int64_t time;
+    uint64_t seq;    // insertion order breaks ties
+    int type;
+    vcar *car;
+} vevent;
+
+
+struct vsim {
+    vsim_config cfg;
+    geom geom;
+
+    pool cars;       // only cars between arrival and exit are live
+    int nsubmitted;
+    int ndone;
+
+    vcar *exited;    // cars exited this time step, recycled in bulk
+    vcar *exited_last;
+    int nexited;
+
+    vevent *heap;
+    int nheap;
+    int heapcap;
+    uint64_t seq;
+
+    int64_t now;
+    int64_t first_arrival;
+    int64_t last_exit;
+
+    vcar *lane_head[GEOM_LANE_SLOTS];
+    vcar *lane_tail[GEOM_LANE_SLOTS];
+    int lane_stopping[GEOM_LANE_SLOTS];   // arrived, stop not finished
+
+    // platoon mode: last car to enter from each lane while it still
+    // holds its cells, and when it entered
+    vcar *plat_tail[GEOM_LANE_SLOTS];
+    int64_t plat_start[GEOM_LANE_SLOTS];
+
+    // cell ownership: a cell is shared only by cars with one sharing key
+    geom_mask busy;                       // cells with count > 0
+    geom_mask owned_by[GEOM_MAX_KEYS];    // busy cells per owning key
+    int cell_count[GEOM_MAX_CELLS];
+    int cell_batch[GEOM_MAX_CELLS];       // cars admitted since owner took it
+    int64_t cell_epoch[GEOM_MAX_CELLS];   // when the owner took it
+    int64_t cell_release[GEOM_MAX_CELLS]; // predicted exit of its last holder
+    uint64_t wait_seq;                    // next acquisition queue ticket
+
+    resv_table resv;                      // ADMIT_RESERVE bookings
+    xt_model xt;                          // crossing-time predictions
+
+    vsim_event_fn event_fn;
+    void *event_user;
+
+    vsim_event *ring;            // capacity is a power of two
+    uint32_t ring_mask;
+    uint32_t ring_head;          // next slot to drain
+    uint32_t ring_tail;          // next slot to fill
+    uint64_t dropped;
+
+    trace_car *trace;            // one record per exited car, when enabled
+    int ntrace;
+    int tracecap;
+    int tracing;
+
+    cols_writer *results;        // per-car rows, when enabled
+
+    // running statistics, updated at exit
+    double lat_sum;
+    double delay_sum;
+    double lat_max;
+    double wait_max[GEOM_MAX_LEGS];       // stop complete -> entry
+    ohist lat;                            // arrival -> exit, microseconds
+    owindow exits;                        // cars per minute
+    int nwaiting;                         // arrived, not yet crossing
+    oema queue;                           // moving average of nwaiting
+    int backfills;
+    int overruns;
+};
+
+
+// Event heap ordered by (time, seq)
+
+static int ev_before(const vevent *a, const vevent *b) {
+    if (a->time != b->time) return a->time < b->time;
+    return a->seq < b->seq;
+}
+
+static int push_event(vsim *sim, int64_t time, int type, vcar *car) {
+    if (sim->nheap == sim->heapcap) {
+        int ncap = sim->heapcap ? sim->heapcap * 2 : 64;
+        vevent *h = realloc(sim->heap, ncap * sizeof(vevent));
+        if (!h) return -1;
+        sim->heap = h;
+        sim->heapcap = ncap;
+    }
+    int i = sim->nheap++;
+    vevent ev = { time, sim->seq++, type, car };
+    while (i > 0) {
+        int p = (i - 1) / 2;
+        if (!ev_before(&ev, &sim->heap[p])) break;
+        sim->heap[i] = sim->heap[p];
+        i = p;
+    }
+    sim->heap[i] = ev;
+    return 0;
+}
+
+static vevent pop_event(vsim *sim) {
+    vevent top = sim->heap[0];
+    vevent last = sim->heap[--sim->nheap];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= sim->nheap) break;
+        if (c + 1 < sim->nheap && ev_before(&sim->heap[c + 1], &sim->heap[c]))
+            c++;
+        if (!ev_before(&sim->heap[c], &last)) break;
+        sim->heap[i] = sim->heap[c];
+        i = c;
+    }
+    if (sim->nheap > 0) sim->heap[i] = last;
+    return top;
+}
+
+
+void vsim_default_config(vsim_config *cfg) {
+    cfg->stop_time = 2000000;
+    cfg->delta_l   = 5000000;
+    cfg->delta_s   = 4000000;
+    cfg->delta_r   = 3000000;
+    cfg->geom      = NULL;
+    cfg->admit     = ADMIT_HOLD;
+    cfg->reserve_margin = 500000;
+    cfg->platoon_headway = 0;
+    cfg->share_max_batch = 0;
+    cfg->share_max_age   = 0;
+    cfg->cross_spread = 0;
+    cfg->cross_seed   = 1;
+    cfg->cross_learn  = 0;
+    cfg->backfill     = 0;
+}
+
+
+vsim *vsim_create(const vsim_config *cfg) {
+    vsim *sim = calloc(1, sizeof(vsim));
+    if (!sim) return NULL;
+    if (cfg) sim->cfg = *cfg;
+    else vsim_default_config(&sim->cfg);
+
+    if (sim->cfg.geom) sim->geom = *sim->cfg.geom;
+    else geom_default(&sim->geom);
+    sim->cfg.geom = &sim->geom;
+
+    pool_init(&sim->cars, sizeof(vcar));
+    resv_init(&sim->resv, sim->cfg.reserve_margin);
+    xt_init(&sim->xt, sim->cfg.cross_spread, sim->cfg.cross_seed, sim->cfg.cross_learn);
+    owindow_init(&sim->exits, MINUTE);
+    oema_init(&sim->queue, QUEUE_TAU);
+    sim->first_arrival = -1;
+    return sim;
+}
+
+
+void vsim_destroy(vsim *sim) {
+    if (!sim) return;
+    vsim_close_results(sim);
+    free(sim->ring);
+    free(sim->trace);
+    resv_free(&sim->resv);
+    pool_destroy(&sim->cars);
+    free(sim->heap);
+    free(sim);
+}
+
+
+int vsim_submit_car(vsim *sim, int cid, int64_t arrival, char orig, char target) {
+    int dir = geom_leg(&sim->geom, orig);
+    int tgt = geom_leg(&sim->geom, target);
+    if (dir < 0 || tgt < 0) return -1;
+    int turn = sim->geom.move_turn[dir][tgt];
+    if (turn == TURN_NONE) return -1;
+    if (arrival < sim->now) arrival = sim->now;
+
+    vcar *car = pool_get(&sim->cars);
+    if (!car) return -1;
+
+    memset(car, 0, sizeof(*car));
+    car->cid = cid;
+    car->orig = orig;
+    car->target = target;
+    car->dir = dir;
+    car->key = geom_key(&sim->geom, dir, tgt);
+    car->tgt = tgt;
+    car->lane = geom_lane(&sim->geom, dir, tgt);
+    car->mask = sim->geom.move_mask[dir][tgt];
+    car->nominal = turn == TURN_LEFT     ? sim->cfg.delta_l :
+                   turn == TURN_STRAIGHT ? sim->cfg.delta_s : sim->cfg.delta_r;
+    car->cross_time = xt_draw(&sim->xt, cid, car->nominal);
+    car->arrival = arrival;
+    car->state = VC_PENDING;
+
+    if (sim->first_arrival < 0 || arrival < sim->first_arrival)
+        sim->first_arrival = arrival;
+    if (push_event(sim, arrival, EV_ARRIVE, car) != 0) {
+        pool_put(&sim->cars, car);
+        return -1;
+    }
+    sim->nsubmitted++;
+    return 0;
+}
+
+
+// Publish a phase change to the callback and/or ring
+
+static void emit(vsim *sim, const vcar *car, int type) {
+    if (!sim->event_fn && !sim->ring) return;
+
+    vsim_event ev = { sim->now, car->cid, type, car->orig, car->target };
+    if (sim->event_fn)
+        sim->event_fn(&ev, sim->event_user);
+    if (sim->ring) {
+        if (sim->ring_tail - sim->ring_head > sim->ring_mask) {
+            sim->dropped++;
+            return;
+        }
+        sim->ring[sim->ring_tail++ & sim->ring_mask] = ev;
+    }
+}
+
+
+// Append car to its lane; becomes head if lane was empty
+
+static void lane_push(vsim *sim, vcar *car) {
+    int d = car->lane;
+    car->next = NULL;
+    if (!sim->lane_tail[d]) {
+        sim->lane_head[d] = sim->lane_tail[d] = car;
+        car->state = VC_HEAD;
+        car->front = sim->now;
+    } else {
+        sim->lane_tail[d]->next = car;
+        sim->lane_tail[d] = car;
+        car->state = VC_QUEUED;
+    }
+}
+
+
+// Head car started crossing: hand the lane to the next car
+
+static void lane_pop(vsim *sim, int d) {
+    vcar *n = sim->lane_head[d]->next;
+    sim->lane_head[d] = n;
+    if (!n) {
+        sim->lane_tail[d] = NULL;
+    } else {
+        n->state = VC_HEAD;
+        n->front = sim->now;
+    }
+}
+
+
+// Same rule as earlier_car_waiting() in tc.c; only lane heads can be
+// at the front and waiting, so scanning the heads is enough. Heads of
+// other lanes on the same leg do not block.
+
+static int earlier_car_waiting(const vsim *sim, const vcar *car) {
+    for (int d = 0; d < sim->geom.nlegs; d++) {
+        if (d == car->dir) continue;
+        for (int k = 0; k < sim->geom.nlanes[d]; k++) {
+            const vcar *o = sim->lane_head[d * GEOM_MAX_LANES + k];
+            if (!o) continue;
+            if ((o->state == VC_HEAD || o->state == VC_ACQUIRING) &&
+                o->stop_complete < car->stop_complete)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Bounded sharing: has the owner of cell c used up its batch or age?
+
+static int cell_closed(const vsim *sim, int c) {
+    if (sim->cfg.share_max_batch && sim->cell_batch[c] >= sim->cfg.share_max_batch)
+        return 1;
+    if (sim->cfg.share_max_age && sim->now - sim->cell_epoch[c] >= sim->cfg.share_max_age)
+        return 1;
+    return 0;
+}
+
+
+// Cells owned by key that no longer accept new cars with it
+
+static geom_mask closed_cells(const vsim *sim, int key) {
+    if (!sim->cfg.share_max_batch && !sim->cfg.share_max_age) return 0;
+    geom_mask closed = 0;
+    for (geom_mask m = sim->owned_by[key]; m; m &= m - 1) {
+        int c = __builtin_ctzll(m);
+        if (cell_closed(sim, c)) closed |= geom_cell(c);
+    }
+    return closed;
+}
+
+
+// Cells a car with this key may not enter now, ignoring the queue
+
+static geom_mask blocked_cells(const vsim *sim, int key) {
+    return (sim->busy & ~sim->owned_by[key]) | closed_cells(sim, key);
+}
+
+
+static int cells_free_for(const vsim *sim, const vcar *car) {
+    return (car->mask & blocked_cells(sim, car->key)) == 0;
+}
+
+
+static void grant_cells(vsim *sim, vcar *car) {
+    for (geom_mask m = car->mask; m; m &= m - 1) {
+        int c = __builtin_ctzll(m);
+        if (sim->cell_count[c]++ == 0) {
+            sim->cell_batch[c] = 0;
+            sim->cell_epoch[c] = sim->now;
+        }
+        sim->cell_batch[c]++;
+    }
+    sim->busy |= car->mask;
+    sim->owned_by[car->key] |= car->mask;
+    car->held = car->mask;
+    car->grant = sim->now;
+}
+
+
+static void release_cells(vsim *sim, vcar *car) {
+    geom_mask freed = 0;
+    for (geom_mask m = car->held; m; m &= m - 1) {
+        int c = __builtin_ctzll(m);
+        if (--sim->cell_count[c] == 0) {
+            freed |= geom_cell(c);
+            sim->cell_release[c] = 0;
+        }
+    }
+    sim->busy &= ~freed;
+    sim->owned_by[car->key] &= ~freed;
+    car->held = 0;
+}
+
+
+// Crossing time the scheduler plans with for this car
+
+static int64_t predict(const vsim *sim, const vcar *car) {
+    return xt_predict(&sim->xt, car->dir, car->tgt, car->nominal);
+}
+
+
+// Cells a car holds are expected back a predicted crossing after start
+
+static void note_release(vsim *sim, const vcar *car, int64_t start) {
+    int64_t end = start + predict(sim, car);
+    for (geom_mask m = car->held; m; m &= m - 1) {
+        int c = __builtin_ctzll(m);
+        if (end > sim->cell_release[c]) sim->cell_release[c] = end;
+    }
+}
+
+
+// Car enters the intersection and hands its lane to the next car
+
+static void start_crossing(vsim *sim, vcar *car) {
+    double wait = (sim->now - car->stop_complete) / 1e6;
+    if (wait > sim->wait_max[car->dir]) sim->wait_max[car->dir] = wait;
+
+    car->state = VC_CROSSING;
+    car->cross_start = sim->now;
+    note_release(sim, car, sim->now);
+    if (car->held && car->cross_time > predict(sim, car)) sim->overruns++;
+    sim->nwaiting--;
+    push_event(sim, sim->now + car->cross_time, EV_EXIT, car);
+    lane_pop(sim, car->lane);
+    emit(sim, car, VSIM_CROSSING);
+}
+
+
+// Platoon mode: a lane head with the same movement as the car that just
+// entered from its lane takes the same cells right away (the leader
+// still holds them, so same-key sharing always allows it) and follows
+// one headway behind, skipping the earlier-car check and the queue.
+// A closed cell ends the platoon.
+
+static int try_follow(vsim *sim, vcar *car) {
+    vcar *lead = sim->plat_tail[car->lane];
+    if (!sim->cfg.platoon_headway || !lead || lead->tgt != car->tgt)
+        return 0;
+    if (!cells_free_for(sim, car))
+        return 0;
+
+    grant_cells(sim, car);
+
+    int64_t start = sim->plat_start[car->lane] + sim->cfg.platoon_headway;
+    if (start < sim->now) start = sim->now;
+    sim->plat_tail[car->lane] = car;
+    sim->plat_start[car->lane] = start;
+
+    if (start == sim->now) {
+        start_crossing(sim, car);
+    } else {
+        car->state = VC_FOLLOWING;
+        note_release(sim, car, start);
+        push_event(sim, start, EV_CROSS, car);
+    }
+    return 1;
+}
+
+
+// Grant whole paths to acquiring cars in queue order. A car may pass an
+// earlier one only if it shares no cell with it or has the same sharing
+// key, as with the wait queue in tc.c.
+
+static int grant_queue(vsim *sim) {
+    vcar *q[GEOM_LANE_SLOTS];
+    int n = 0;
+    for (int d = 0; d < GEOM_LANE_SLOTS; d++) {
+        vcar *car = sim->lane_head[d];
+        if (!car || car->state != VC_ACQUIRING) continue;
+        int i = n++;
+        while (i > 0 && q[i - 1]->wait_seq > car->wait_seq) {
+            q[i] = q[i - 1];
+            i--;
+        }
+        q[i] = car;
+    }
+    if (n == 0) return 0;
+
+    // test every path against the current state in one go; grants made
+    // below only add blocked cells, so a car that fails here stays out
+    geom_mask masks[GEOM_LANE_SLOTS], blocked[GEOM_LANE_SLOTS];
+    geom_mask key_blocked[GEOM_MAX_KEYS];
+    uint32_t have_key = 0;
+    for (int i = 0; i < n; i++) {
+        int k = q[i]->key;
+        if (!(have_key & (1u << k))) {
+            key_blocked[k] = blocked_cells(sim, k);
+            have_key |= 1u << k;
+        }
+        masks[i] = q[i]->mask;
+        blocked[i] = key_blocked[k];
+    }
+    uint64_t free = batch_free_paths(masks, blocked, n);
+
+    geom_mask ahead[GEOM_MAX_KEYS] = {0};
+    geom_mask ahead_all = 0;
+    int granted = 0;
+    for (int i = 0; i < n; i++) {
+        vcar *car = q[i];
+        geom_mask others = ahead_all & ~ahead[car->key];
+        int ok = (free >> i & 1) && !(car->mask & others);
+        // an earlier grant in this pass may have taken or closed its cells
+        if (ok && granted) ok = cells_free_for(sim, car);
+        if (ok) {
+            grant_cells(sim, car);
+            if (sim->cfg.platoon_headway) {
+                sim->plat_tail[car->lane] = car;
+                sim->plat_start[car->lane] = sim->now;
+            }
+            start_crossing(sim, car);
+            granted = 1;
+        } else {
+            ahead[car->key] |= car->mask;
+            ahead_all |= car->mask;
+        }
+    }
+    return granted;
+}
+
+
+// Backfilling: a lane head held back by earlier stopped cars may go now
+// if its path is free and, by predicted crossing times, it will be out
+// of every cell it shares with a waiting car before that car could have
+// the cell anyway. Waiting cars are then not delayed unless someone
+// overruns the prediction. A car whose own path is free right now is
+// never backfilled around, and acquiring cars are protected whatever
+// their stop time, as their queue position would have been.
+
+static int try_backfill(vsim *sim, vcar *car) {
+    if (!cells_free_for(sim, car)) return 0;
+    int64_t done = sim->now + predict(sim, car);
+
+    for (int d = 0; d < GEOM_LANE_SLOTS; d++) {
+        const vcar *o = sim->lane_head[d];
+        if (!o || o == car) continue;
+        int protect = o->state == VC_ACQUIRING ||
+                      (o->state == VC_HEAD && o->dir != car->dir &&
+                       o->stop_complete < car->stop_complete);
+        if (!protect || o->key == car->key || !(o->mask & car->mask)) continue;
+
+        geom_mask need = o->mask & blocked_cells(sim, o->key);
+        if (!need) return 0;
+        int64_t ready = 0;
+        for (geom_mask m = need; m; m &= m - 1) {
+            int c = __builtin_ctzll(m);
+            if (sim->cell_release[c] > ready) ready = sim->cell_release[c];
+        }
+        if (done > ready) return 0;
+    }
+
+    grant_cells(sim, car);
+    if (sim->cfg.platoon_headway) {
+        sim->plat_tail[car->lane] = car;
+        sim->plat_start[car->lane] = sim->now;
+    }
+    start_crossing(sim, car);
+    sim->backfills++;
+    return 1;
+}
+
+
+// Hold-all model: admit as many lane heads as the current state allows
+
+static void schedule_hold(vsim *sim) {
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        for (int d = 0; d < GEOM_LANE_SLOTS; d++) {
+            vcar *car = sim->lane_head[d];
+            if (!car) continue;
+
+            if (car->state == VC_HEAD && try_follow(sim, car)) {
+                progress = 1;
+                continue;
+            }
+            if (car->state == VC_HEAD && !earlier_car_waiting(sim, car)) {
+                car->state = VC_ACQUIRING;
+                car->wait_seq = sim->wait_seq++;
+                progress = 1;
+            } else if (car->state == VC_HEAD && sim->cfg.backfill &&
+                       try_backfill(sim, car)) {
+                progress = 1;
+            }
+        }
+        if (grant_queue(sim)) progress = 1;
+    }
+}
+
+
+// Reservation model: new lane heads book the earliest free slot along
+// their path, earliest stop first, and cross when the slot starts. The
+// booking covers the predicted crossing time; a car that takes longer
+// is counted as an overrun.
+
+static void schedule_reserve(vsim *sim) {
+    for (;;) {
+        vcar *next = NULL;
+        for (int d = 0; d < GEOM_LANE_SLOTS; d++) {
+            vcar *car = sim->lane_head[d];
+            if (car && car->state == VC_HEAD &&
+                (!next || car->stop_complete < next->stop_complete))
+                next = car;
+        }
+        if (!next) break;
+
+        int64_t book = predict(sim, next);
+        int64_t start = resv_earliest(&sim->resv, &sim->geom, next->dir,
+                                      next->tgt, sim->now, book);
+        if (resv_commit(&sim->resv, &sim->geom, next->dir, next->tgt, start, book) != 0) {
+            // could not store the booking: the heads wait and are
+            // planned again on the retry event
+            push_event(sim, sim->now + RESV_RETRY, EV_RETRY, next);
+            break;
+        }
+        if (next->cross_time > book) sim->overruns++;
+        next->grant = sim->now;
+        if (start == sim->now) {
+            start_crossing(sim, next);
+        } else {
+            next->state = VC_RESERVED;
+            push_event(sim, start, EV_CROSS, next);
+        }
+    }
+}
+
+
+static void schedule(vsim *sim) {
+    if (sim->cfg.admit == ADMIT_RESERVE)
+        schedule_reserve(sim);
+    else
+        schedule_hold(sim);
+}
+
+
+// Fold an exiting car into the running statistics
+
+static void record_exit(vsim *sim, const vcar *car) {
+    int64_t lat = car->exit_time - car->arrival;
+    double l = lat / 1e6;
+
+    // platoon followers that joined on arrival made no stop
+    int64_t unhindered = car->stop_complete - car->arrival + car->cross_time;
+    sim->ndone++;
+    sim->lat_sum += l;
+    sim->delay_sum += l - unhindered / 1e6;
+    if (l > sim->lat_max) sim->lat_max = l;
+    if (car->exit_time > sim->last_exit) sim->last_exit = car->exit_time;
+
+    ohist_add(&sim->lat, lat);
+    owindow_add(&sim->exits, car->exit_time);
+
+    if (!sim->tracing && !sim->results) return;
+    trace_car rec = {
+        car->cid, car->orig, car->target, car->arrival, car->stop_complete,
+        car->front, car->grant, car->cross_start, car->exit_time,
+        sim->cfg.admit == ADMIT_HOLD ? car->mask : 0
+    };
+    if (sim->results)
+        cols_add(sim->results, &rec, lat - unhindered);
+
+    if (!sim->tracing) return;
+    if (sim->ntrace == sim->tracecap) {
+        int ncap = sim->tracecap ? sim->tracecap * 2 : 256;
+        trace_car *t = realloc(sim->trace, ncap * sizeof(trace_car));
+        if (!t) return;
+        sim->trace = t;
+        sim->tracecap = ncap;
+    }
+    sim->trace[sim->ntrace++] = rec;
+}
+
+
+static void handle_event(vsim *sim, const vevent *ev) {
+    vcar *car = ev->car;
+    switch (ev->type) {
+        case EV_ARRIVE:
+            car->state = VC_STOPPING;
+            sim->nwaiting++;
+            emit(sim, car, VSIM_ARRIVING);
+            // nobody ahead and the leader is still in the intersection:
+            // join the platoon without stopping
+            if (sim->cfg.admit == ADMIT_HOLD && sim->plat_tail[car->lane] &&
+                sim->plat_tail[car->lane]->tgt == car->tgt &&
+                !sim->lane_head[car->lane] && !sim->lane_stopping[car->lane]) {
+                car->stop_complete = sim->now;
+                lane_push(sim, car);
+                break;
+            }
+            sim->lane_stopping[car->lane]++;
+            push_event(sim, sim->now + sim->cfg.stop_time, EV_STOP, car);
+            break;
+        case EV_STOP:
+            sim->lane_stopping[car->lane]--;
+            car->stop_complete = sim->now;
+            lane_push(sim, car);
+            break;
+        case EV_CROSS:
+            start_crossing(sim, car);
+            break;
+        case EV_RETRY:
+            // schedule() after this batch plans the car again
+            break;
+        case EV_EXIT:
+            if (sim->plat_tail[car->lane] == car)
+                sim->plat_tail[car->lane] = NULL;
+            release_cells(sim, car);
+            xt_observe(&sim->xt, car->dir, car->tgt, sim->now - car->cross_start);
+            car->exit_time = sim->now;
+            car->state = VC_DONE;
+            record_exit(sim, car);
+            emit(sim, car, VSIM_EXITING);
+
+            car->next = sim->exited;
+            if (!sim->exited) sim->exited_last = car;
+            sim->exited = car;
+            sim->nexited++;
+            break;
+    }
+}
+
+
+void vsim_advance(vsim *sim, int64_t until) {
+    while (sim->nheap > 0 && sim->heap[0].time <= until) {
+        sim->now = sim->heap[0].time;
+        while (sim->nheap > 0 && sim->heap[0].time == sim->now) {
+            vevent ev = pop_event(sim);
+            handle_event(sim, &ev);
+        }
+        schedule(sim);
+        oema_sample(&sim->queue, sim->now, sim->nwaiting);
+
+        pool_put_chain(&sim->cars, sim->exited, sim->exited_last, sim->nexited);
+        sim->exited = sim->exited_last = NULL;
+        sim->nexited = 0;
+    }
+    if (until > sim->now) sim->now = until;
+}
+
+
+void vsim_run(vsim *sim) {
+    while (sim->nheap > 0)
+        vsim_advance(sim, sim->heap[0].time);
+}
+
+
+int64_t vsim_now(const vsim *sim) {
+    return sim->now;
+}
+
+
+void vsim_set_callback(vsim *sim, vsim_event_fn fn, void *user) {
+    sim->event_fn = fn;
+    sim->event_user = user;
+}
+
+
+int vsim_enable_ring(vsim *sim, int capacity) {
+    free(sim->ring);
+    sim->ring = NULL;
+    sim->ring_mask = 0;
+    sim->ring_head = sim->ring_tail = 0;
+    if (capacity <= 0) return 0;
+
+    uint32_t cap = 1;
+    while (cap < (uint32_t)capacity) cap <<= 1;
+    sim->ring = malloc(cap * sizeof(vsim_event));
+    if (!sim->ring) return -1;
+    sim->ring_mask = cap - 1;
+    return 0;
+}
+
+
+void vsim_enable_trace(vsim *sim) {
+    sim->tracing = 1;
+}
+
+
+int vsim_write_trace(const vsim *sim, const char *path) {
+    FILE *f = trace_begin(path, &sim->geom);
+    if (!f) return -1;
+    for (int i = 0; i < sim->ntrace; i++)
+        trace_add(f, &sim->trace[i]);
+    return trace_end(f);
+}
+
+
+int vsim_open_results(vsim *sim, const char *path) {
+    vsim_close_results(sim);
+    sim->results = cols_open(path);
+    return sim->results ? 0 : -1;
+}
+
+
+int vsim_close_results(vsim *sim) {
+    if (!sim->results) return 0;
+    int rc = cols_close(sim->results);
+    sim->results = NULL;
+    return rc;
+}
+
+
+int vsim_drain_events(vsim *sim, vsim_event *buf, int max) {
+    int n = 0;
+    while (n < max && sim->ring_head != sim->ring_tail)
+        buf[n++] = sim->ring[sim->ring_head++ & sim->ring_mask];
+    return n;
+}
+
+
+uint64_t vsim_events_dropped(const vsim *sim) {
+    return sim->dropped;
+}
+
+
+void vsim_get_stats(const vsim *sim, vsim_stats *out) {
+    memset(out, 0, sizeof(*out));
+    int n = sim->ndone;
+    if (n == 0) return;
+
+    out->cars = n;
+    out->sim_time = (sim->last_exit - sim->first_arrival) / 1e6;
+    out->throughput = out->sim_time > 0 ? n / out->sim_time : 0;
+    out->mean_latency = sim->lat_sum / n;
+    out->mean_delay = sim->delay_sum / n;
+    out->max_latency = sim->lat_max;
+    for (int d = 0; d < GEOM_MAX_LEGS; d++) {
+        out->leg_max_wait[d] = sim->wait_max[d];
+        if (sim->wait_max[d] > out->max_wait) out->max_wait = sim->wait_max[d];
+    }
+
+    out->p50_latency = ohist_quantile(&sim->lat, 0.50) / 1e6;
+    out->p95_latency = ohist_quantile(&sim->lat, 0.95) / 1e6;
+    out->p99_latency = ohist_quantile(&sim->lat, 0.99) / 1e6;
+    out->minute_min = (int)sim->exits.min;
+    out->minute_max = (int)sim->exits.max;
+    out->queue_avg = sim->queue.value;
+    out->backfills = sim->backfills;
+    out->overruns = sim->overruns;
+}
+
+
+// Checkpoint file: magic, config and geometry, the scalar and per-cell
+// state, then the live cars followed by everything that points at them
+// (event heap, lane queues, platoon tails) as indices into that list,
+// the reservation table and any trace records. Host byte order.
+
+#define CKPT_MAGIC "VSIMCKP2"
+
+
+// Reads or writes n bytes; returns 0 on success
+
+static int xfer(FILE *f, void *p, size_t n, int save) {
+    return (save ? fwrite(p, 1, n, f) : fread(p, 1, n, f)) == n ? 0 : -1;
+}
+
+#define XFER(x) do { if (xfer(f, &(x), sizeof(x), save)) return -1; } while (0)
+
+
+// Everything that holds no pointers, one list for both directions
+
+static int xfer_state(vsim *sim, FILE *f, int save) {
+    XFER(sim->nsubmitted);
+    XFER(sim->ndone);
+    XFER(sim->seq);
+    XFER(sim->now);
+    XFER(sim->first_arrival);
+    XFER(sim->last_exit);
+    XFER(sim->lane_stopping);
+    XFER(sim->plat_start);
+    XFER(sim->busy);
+    XFER(sim->owned_by);
+    XFER(sim->cell_count);
+    XFER(sim->cell_batch);
+    XFER(sim->cell_epoch);
+    XFER(sim->wait_seq);
+    XFER(sim->lat_sum);
+    XFER(sim->delay_sum);
+    XFER(sim->lat_max);
+    XFER(sim->wait_max);
+    XFER(sim->lat);
+    XFER(sim->exits);
+    XFER(sim->nwaiting);
+    XFER(sim->queue);
+    XFER(sim->cell_release);
+    XFER(sim->xt);
+    XFER(sim->backfills);
+    XFER(sim->overruns);
+    return 0;
+}
+
+
+static int ptr_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(vcar* const*)a, y = (uintptr_t)*(vcar* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Index of a live car in the sorted list, -1 for NULL
+static int32_t car_index(vcar **cars, int n, const vcar *car) {
+    if (!car) return -1;
+    vcar **hit = bsearch(&car, cars, n, sizeof(vcar*), ptr_cmp);
+    return (int32_t)(hit - cars);
+}
+
+
+static int save_body(vsim *sim, FILE *f, vcar **cars, int ncars) {
+    const int save = 1;
+    vsim_config cfg = sim->cfg;
+    cfg.geom = NULL;
+    XFER(cfg);
+    XFER(sim->geom);
+    if (xfer_state(sim, f, save)) return -1;
+
+    XFER(ncars);
+    for (int i = 0; i < ncars; i++) {
+        vcar c = *cars[i];
+        c.next = NULL;
+        XFER(c);
+    }
+
+    XFER(sim->nheap);
+    for (int i = 0; i < sim->nheap; i++) {
+        vevent *ev = &sim->heap[i];
+        int32_t idx = car_index(cars, ncars, ev->car);
+        XFER(ev->time);
+        XFER(ev->seq);
+        XFER(ev->type);
+        XFER(idx);
+    }
+
+    for (int d = 0; d < GEOM_LANE_SLOTS; d++) {
+        int32_t n = 0;
+        for (vcar *c = sim->lane_head[d]; c; c = c->next) n++;
+        XFER(n);
+        for (vcar *c = sim->lane_head[d]; c; c = c->next) {
+            int32_t idx = car_index(cars, ncars, c);
+            XFER(idx);
+        }
+        int32_t tail = car_index(cars, ncars, sim->plat_tail[d]);
+        XFER(tail);
+    }
+
+    for (int c = 0; c < GEOM_MAX_CELLS; c++) {
+        resv_cell *cell = &sim->resv.cells[c];
+        XFER(cell->n);
+        if (cell->n && xfer(f, cell->slots, cell->n * sizeof(resv_slot), save)) return -1;
+    }
+
+    XFER(sim->tracing);
+    XFER(sim->ntrace);
+    if (sim->ntrace && xfer(f, sim->trace, sim->ntrace * sizeof(trace_car), save)) return -1;
+    return 0;
+}
+
+
+static int save_to(vsim *sim, FILE *f) {
+    // live cars are those with a pending event or a place in a lane
+    int ncars = 0;
+    vcar **cars = malloc((sim->nheap + sim->cars.live + 1) * sizeof(vcar*));
+    if (!cars) return -1;
+    for (int i = 0; i < sim->nheap; i++)
+        cars[ncars++] = sim->heap[i].car;
+    for (int d = 0; d < GEOM_LANE_SLOTS; d++)
+        for (vcar *c = sim->lane_head[d]; c; c = c->next)
+            cars[ncars++] = c;
+    qsort(cars, ncars, sizeof(vcar*), ptr_cmp);
+    int n = 0;
+    for (int i = 0; i < ncars; i++)
+        if (n == 0 || cars[i] != cars[n - 1]) cars[n++] = cars[i];
+
+    int err = fwrite(CKPT_MAGIC, 1, 8, f) != 8 || save_body(sim, f, cars, n) != 0;
+    free(cars);
+    return err ? -1 : 0;
+}
+
+
+int vsim_save(const vsim *sim, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    // save_to() only reads the vsim; the cast serves the shared field list
+    int err = save_to((vsim*)sim, f) != 0;
+    if (fclose(f) != 0) err = 1;
+    if (err) {
+        fprintf(stderr, "%s: write failed\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int load_body(vsim *sim, FILE *f) {
+    const int save = 0;
+    if (xfer_state(sim, f, save)) return -1;
+
+    int ncars;
+    XFER(ncars);
+    if (ncars < 0) return -1;
+    vcar **cars = malloc((ncars + 1) * sizeof(vcar*));
+    if (!cars) return -1;
+    int err = 0;
+    for (int i = 0; i < ncars && !err; i++) {
+        cars[i] = pool_get(&sim->cars);
+        err = !cars[i] || xfer(f, cars[i], sizeof(vcar), save);
+    }
+
+    if (!err) err = xfer(f, &sim->nheap, sizeof(sim->nheap), save) || sim->nheap < 0;
+    if (!err) {
+        sim->heapcap = sim->nheap > 64 ? sim->nheap : 64;
+        sim->heap = malloc(sim->heapcap * sizeof(vevent));
+        err = !sim->heap;
+    }
+    for (int i = 0; i < sim->nheap && !err; i++) {
+        vevent *ev = &sim->heap[i];
+        int32_t idx;
+        err = xfer(f, &ev->time, sizeof(ev->time), save) ||
+              xfer(f, &ev->seq, sizeof(ev->seq), save) ||
+              xfer(f, &ev->type, sizeof(ev->type), save) ||
+              xfer(f, &idx, sizeof(idx), save) || idx < 0 || idx >= ncars;
+        if (!err) ev->car = cars[idx];
+    }
+
+    for (int d = 0; d < GEOM_LANE_SLOTS && !err; d++) {
+        int32_t n, idx;
+        err = xfer(f, &n, sizeof(n), save);
+        for (int32_t k = 0; k < n && !err; k++) {
+            err = xfer(f, &idx, sizeof(idx), save) || idx < 0 || idx >= ncars;
+            if (err) break;
+            vcar *c = cars[idx];
+            c->next = NULL;
+            if (sim->lane_tail[d]) sim->lane_tail[d]->next = c;
+            else sim->lane_head[d] = c;
+            sim->lane_tail[d] = c;
+        }
+        if (!err) err = xfer(f, &idx, sizeof(idx), save) || idx < -1 || idx >= ncars;
+        if (!err) sim->plat_tail[d] = idx < 0 ? NULL : cars[idx];
+    }
+    free(cars);
+
+    for (int c = 0; c < GEOM_MAX_CELLS && !err; c++) {
+        resv_cell *cell = &sim->resv.cells[c];
+        err = xfer(f, &cell->n, sizeof(cell->n), save) || cell->n < 0;
+        if (err || !cell->n) continue;
+        cell->cap = cell->n;
+        cell->slots = malloc(cell->n * sizeof(resv_slot));
+        err = !cell->slots || xfer(f, cell->slots, cell->n * sizeof(resv_slot), save);
+    }
+
+    if (!err) err = xfer(f, &sim->tracing, sizeof(sim->tracing), save) ||
+                    xfer(f, &sim->ntrace, sizeof(sim->ntrace), save) || sim->ntrace < 0;
+    if (!err && sim->ntrace) {
+        sim->tracecap = sim->ntrace;
+        sim->trace = malloc(sim->ntrace * sizeof(trace_car));
+        err = !sim->trace || xfer(f, sim->trace, sim->ntrace * sizeof(trace_car), save);
+    }
+    return err ? -1 : 0;
+}
+
+
+static vsim *load_from(FILE *f) {
+    char magic[8];
+    vsim_config cfg;
+    geom g;
+    vsim *sim = NULL;
+    if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, CKPT_MAGIC, 8) &&
+        fread(&cfg, sizeof(cfg), 1, f) == 1 && fread(&g, sizeof(g), 1, f) == 1) {
+        cfg.geom = &g;
+        sim = vsim_create(&cfg);
+        if (sim && load_body(sim, f) != 0) {
+            vsim_destroy(sim);
+            sim = NULL;
+        }
+    }
+    return sim;
+}
+
+
+vsim *vsim_load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    vsim *sim = load_from(f);
+    if (!sim) fprintf(stderr, "%s: not a usable checkpoint\n", path);
+    fclose(f);
+    return sim;
+}
+
+
+// Round trip through an in-memory checkpoint
+
+vsim *vsim_clone(const vsim *sim) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) return NULL;
+    int err = save_to((vsim*)sim, f) != 0;
+    if (fclose(f) != 0) err = 1;
+
+    vsim *copy = NULL;
+    if (!err && (f = fmemopen(buf, len, "rb")) != NULL) {
+        copy = load_from(f);
+        fclose(f);
+    }
+    free(buf);
+    return copy;
+}
+
+
+void vsim_reset_stats(vsim *sim) {
+    sim->ndone = 0;
+    sim->first_arrival = sim->now;
+    sim->last_exit = sim->now;
+    sim->lat_sum = 0;
+    sim->delay_sum = 0;
+    sim->lat_max = 0;
+    memset(sim->wait_max, 0, sizeof(sim->wait_max));
+    memset(&sim->lat, 0, sizeof(sim->lat));
+    owindow_init(&sim->exits, MINUTE);
+    sim->backfills = 0;
+    sim->overruns = 0;
+    sim->ntrace = 0;
+}
+
+
+// Only draws for cars added from now on change; learned estimates stay
+
+void vsim_reseed(vsim *sim, uint64_t cross_seed) {
+    sim->cfg.cross_seed = cross_seed;
+    sim->xt.seed = cross_seed;
+}
@@ -0,0 +1,159 @@
+#ifndef VSIM_H
+#define VSIM_H
+
+#include <stdint.h>
+#include "geom.h"
+#include "resv.h"
+#include "xtime.h"
+
+
+// Virtual-time intersection simulator
+//
+// Same admission rules as the threaded simulator in tc.c (stop, head of
+// lane, earlier-stop priority, quadrant sharing by direction) but driven
+// by an event queue instead of sleeping threads. Every simulation is a
+// self-contained vsim object, so any number can run in parallel.
+//
+// Library build: gcc -O2 -c vsim.c pool.c geom.c resv.c trace.c batch.c
+//                    cols.c ostats.c xtime.c &&
+//                ar rcs libvsim.a vsim.o pool.o geom.o resv.o trace.o
+//                    batch.o cols.o ostats.o xtime.o
+//
+// Embedding: submit cars as sensors report them, call vsim_advance() with
+// the current time, and consume decisions either through a callback or by
+// polling vsim_drain_events(). A vsim is not thread-safe; drive each one
+// from a single thread.
+
+
+// Timing configuration (microseconds) and geometry
+
+typedef struct {
+    int64_t stop_time;
+    int64_t delta_l;
+    int64_t delta_s;
+    int64_t delta_r;
+    const geom *geom;        // copied at create; NULL = default 4-way
+    int admit;               // ADMIT_HOLD or ADMIT_RESERVE
+    int64_t reserve_margin;  // per-cell slack in reservation mode
+    int64_t platoon_headway; // hold mode: follow same-movement leader, 0 = off
+    int     share_max_batch; // cars one leg may add to a held cell, 0 = no limit
+    int64_t share_max_age;   // how long one leg may keep adding, 0 = no limit
+    double  cross_spread;    // relative spread of actual crossing times, see xtime.h
+    uint64_t cross_seed;     // draws for cross_spread
+    int     cross_learn;     // predict crossing times from observed ones
+    int     backfill;        // hold mode: let a car pass earlier waiting cars
+                             // it is predicted not to delay
+} vsim_config;
+
+
+// Summary statistics for one finished run
+
+typedef struct {
+    int     cars;            // cars that exited
+    double  sim_time;        // seconds from first arrival to last exit
+    double  throughput;      // cars per simulated second
+    double  mean_latency;    // arrival -> exit, seconds
+    double  p50_latency;     // quantiles within 1.6%, see ostats.h
+    double  p95_latency;
+    double  p99_latency;
+    double  max_latency;
+    double  mean_delay;      // latency minus stop made and actual crossing time
+    double  max_wait;        // longest stop-complete -> entry wait, seconds
+    double  leg_max_wait[GEOM_MAX_LEGS];
+    int     minute_min;      // fewest and most exits in a full minute
+    int     minute_max;
+    double  queue_avg;       // cars waiting, 60 s moving average at the end
+    int     backfills;       // cars admitted ahead of earlier waiting cars
+    int     overruns;        // cars that crossed longer than planned for
+} vsim_stats;
+
+
+// Decision stream, one entry per car phase change
+
+enum {
+    VSIM_ARRIVING,
+    VSIM_CROSSING,
+    VSIM_EXITING
+};
+
+typedef struct {
+    int64_t time;    // virtual microseconds
+    int cid;
+    int type;        // VSIM_*
+    char orig;
+    char target;
+} vsim_event;
+
+typedef void (*vsim_event_fn)(const vsim_event *ev, void *user);
+
+
+typedef struct vsim vsim;
+
+void vsim_default_config(vsim_config *cfg);
+
+vsim *vsim_create(const vsim_config *cfg);
+void  vsim_destroy(vsim *sim);
+
+// Queue a car; arrival is in microseconds of virtual time. Arrivals in
+// the past are treated as arriving now. Fails if the geometry has no
+// such movement.
+int   vsim_submit_car(vsim *sim, int cid, int64_t arrival, char orig, char target);
+
+// Process everything up to and including time `until`
+void  vsim_advance(vsim *sim, int64_t until);
+
+// Run until every queued car has exited
+void  vsim_run(vsim *sim);
+
+int64_t vsim_now(const vsim *sim);
+
+// Deliver events to fn as they happen (NULL to disable). The callback
+// must not call back into the same vsim.
+void  vsim_set_callback(vsim *sim, vsim_event_fn fn, void *user);
+
+// Buffer events in a ring of `capacity` entries (rounded up to a power of
+// two, 0 disables). When full, new events are counted and dropped.
+int   vsim_enable_ring(vsim *sim, int capacity);
+
+// Copy up to max buffered events into buf, oldest first; returns count
+int   vsim_drain_events(vsim *sim, vsim_event *buf, int max);
+
+uint64_t vsim_events_dropped(const vsim *sim);
+
+// Keep a timeline record of every car from now on, in memory until
+// vsim_write_trace() writes them as Chrome trace JSON (see trace.h)
+void  vsim_enable_trace(vsim *sim);
+int   vsim_write_trace(const vsim *sim, const char *path);
+
+// Stream one row per exiting car from now on to a column-chunk file (see
+// cols.h); memory use stays at one chunk however long the run.
+// vsim_close_results() finishes the file and returns 0 on success;
+// vsim_destroy() closes it too but cannot report errors.
+int   vsim_open_results(vsim *sim, const char *path);
+int   vsim_close_results(vsim *sim);
+
+void  vsim_get_stats(const vsim *sim, vsim_stats *out);
+
+// Write the complete state (clock, pending events, lane queues, cell
+// owners, in-flight cars, statistics, trace records) to a binary file,
+// and create a vsim that carries on from such a file exactly where the
+// saved one was. Call between vsim_advance() calls. The callback, event
+// ring and results file are not saved; set them up again after loading.
+// Files are only readable by a build with the same struct layouts.
+int   vsim_save(const vsim *sim, const char *path);
+vsim *vsim_load(const char *path);
+
+// Independent copy of a vsim in its current state, e.g. one warmed-up
+// intersection as the starting point of many runs
+vsim *vsim_clone(const vsim *sim);
+
+// Start the statistics and trace over from now; cars already in the
+// intersection count when they exit
+void  vsim_reset_stats(vsim *sim);
+
+// New cross_seed for the crossing times of cars added from now on, e.g.
+// to give each run cloned from one warm state its own draws; cars
+// already added keep theirs
+void  vsim_reseed(vsim *sim, uint64_t cross_seed);
+
+#endif
@@ -0,0 +1,62 @@
+#include <math.h>
+#include <string.h>
+#include "xtime.h"
+
+
+void xt_init(xt_model *m, double spread, uint64_t seed, int learn) {
+    memset(m, 0, sizeof(*m));
+    m->spread = spread;
+    m->seed = seed;
+    m->learn = learn;
+}
+
+
+// splitmix64 finalizer: a well mixed 64-bit value per input
+
+static uint64_t mix(uint64_t z) {
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in (0, 1)
+static double unit(uint64_t z) {
+    return ((z >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+
+// Lognormal with mean nominal: log-space sigma^2 = ln(1 + spread^2) and
+// mu = ln(nominal) - sigma^2 / 2; one Box-Muller normal per car
+
+int64_t xt_draw(const xt_model *m, int cid, int64_t nominal) {
+    if (m->spread <= 0 || nominal <= 0) return nominal;
+    uint64_t z = mix(m->seed ^ mix((uint64_t)(uint32_t)cid));
+    double u1 = unit(z), u2 = unit(mix(z));
+    double normal = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+
+    double s2 = log1p(m->spread * m->spread);
+    double t = exp(log((double)nominal) - s2 / 2 + sqrt(s2) * normal);
+    return t < 1 ? 1 : (int64_t)llround(t);
+}
+
+
+// Running mean and variance with weight 1/n, falling to 1/XT_WINDOW so
+// the estimate keeps up if crossing times drift
+
+void xt_observe(xt_model *m, int orig, int target, int64_t duration) {
+    if (!m->learn) return;
+    xt_estimate *e = &m->est[orig][target];
+    e->n++;
+    double w = e->n < XT_WINDOW ? 1.0 / e->n : 1.0 / XT_WINDOW;
+    double d = duration - e->mean;
+    e->mean += w * d;
+    e->var = (1 - w) * (e->var + w * d * d);
+}
+
+
+int64_t xt_predict(const xt_model *m, int orig, int target, int64_t nominal) {
+    const xt_estimate *e = &m->est[orig][target];
+    if (!m->learn || e->n < XT_MIN_SAMPLES) return nominal;
+    return (int64_t)ceil(e->mean + XT_SIGMAS * sqrt(e->var));
+}
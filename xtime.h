@@ -0,0 +1,49 @@
+#ifndef XTIME_H
+#define XTIME_H
+
+#include <stdint.h>
+#include "geom.h"
+
+
+// Crossing-time model
+//
+// Real crossing times vary around the configured per-turn times. With a
+// spread > 0 every car draws its own time from a lognormal distribution
+// whose mean is the configured time and whose standard deviation is
+// spread times that. Schedulers never see a car's actual time. They
+// plan with the configured time or, with learning on, with an estimate
+// per movement from the crossings observed so far, which also picks up
+// any systematic difference from the configuration. All times are
+// microseconds.
+
+#define XT_SIGMAS      2.0   // prediction = mean + XT_SIGMAS standard deviations
+#define XT_MIN_SAMPLES 4     // crossings of a movement before its estimate is used
+#define XT_WINDOW      32    // estimates follow about the last XT_WINDOW crossings
+
+typedef struct {
+    uint32_t n;
+    double mean;
+    double var;
+} xt_estimate;
+
+typedef struct {
+    double spread;           // relative standard deviation, 0 = fixed times
+    uint64_t seed;
+    int learn;               // predict from observed crossings
+    xt_estimate est[GEOM_MAX_LEGS][GEOM_MAX_LEGS];
+} xt_model;
+
+void    xt_init(xt_model *m, double spread, uint64_t seed, int learn);
+
+// Actual crossing time of car cid; depends only on the seed, the car and
+// the nominal time, so a car crosses equally fast under every scheduler
+int64_t xt_draw(const xt_model *m, int cid, int64_t nominal);
+
+// Folds in an observed crossing of movement orig -> target (leg indices)
+void    xt_observe(xt_model *m, int orig, int target, int64_t duration);
+
+// Crossing time to plan with: the nominal time, or once learned a high
+// estimate that few cars exceed
+int64_t xt_predict(const xt_model *m, int orig, int target, int64_t nominal);
+
+#endif